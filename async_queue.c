@@ -12,15 +12,31 @@
 
 #include "async_queue.h"
 
+/*
+ * Each cell has a sequence number that tells whether it's ready to be
+ * pushed into (seq == pos) or popped from (seq == pos + 1). Producers claim
+ * cells with compare-and-swap, so any thread can push; there must be only
+ * one consumer at a time, which is the case for the port queues: pad_chain
+ * for the input, output_loop for the output.
+ */
+
 AsyncQueue *
-async_queue_new(void)
+async_queue_new(guint size)
 {
 	AsyncQueue *queue;
+	guint i, n = 2;
+
+	while (n < size)
+		n <<= 1;
 
 	queue = g_slice_new0(AsyncQueue);
 
 	queue->condition = g_cond_new();
 	queue->mutex = g_mutex_new();
+	queue->cells = g_new0(struct async_queue_cell, n);
+	queue->mask = n - 1;
+	for (i = 0; i < n; i++)
+		queue->cells[i].seq = i;
 	queue->enabled = TRUE;
 
 	return queue;
@@ -32,88 +48,112 @@ async_queue_free(AsyncQueue *queue)
 	g_cond_free(queue->condition);
 	g_mutex_free(queue->mutex);
 
-	g_list_free(queue->head);
+	g_free(queue->cells);
 	g_slice_free(AsyncQueue, queue);
 }
 
-void
-async_queue_push(AsyncQueue *queue,
-		 gpointer data)
+static inline gboolean
+try_push(AsyncQueue *queue,
+	 gpointer data)
 {
-	g_mutex_lock(queue->mutex);
-
-	queue->head = g_list_prepend(queue->head, data);
-	if (!queue->tail)
-		queue->tail = queue->head;
-	queue->length++;
+	struct async_queue_cell *cell;
+	guint pos;
+	gint dif;
+
+	/* the compare-and-swap tells whether this was stale */
+	pos = *(volatile gint *) &queue->tail;
+	while (TRUE) {
+		cell = &queue->cells[pos & queue->mask];
+		dif = (gint) ((guint) *(volatile gint *) &cell->seq - pos);
+		if (dif == 0) {
+			if (g_atomic_int_compare_and_exchange(&queue->tail, (gint) pos, (gint) (pos + 1)))
+				break;
+		} else if (dif < 0)
+			return FALSE;
+		pos = *(volatile gint *) &queue->tail;
+	}
 
-	g_cond_signal(queue->condition);
+	cell->data = data;
+	g_atomic_int_set(&cell->seq, pos + 1);
 
-	g_mutex_unlock(queue->mutex);
+	return TRUE;
 }
 
-gpointer
-async_queue_pop(AsyncQueue *queue)
+static inline gpointer
+try_pop(AsyncQueue *queue)
 {
-	gpointer data = NULL;
+	struct async_queue_cell *cell;
+	gpointer data;
+	guint pos;
 
-	g_mutex_lock(queue->mutex);
+	pos = queue->head;
+	cell = &queue->cells[pos & queue->mask];
+	if (*(volatile gint *) &cell->seq != (gint) (pos + 1))
+		return NULL;
 
-	if (!queue->enabled)
-		goto leave;
+	/* read the data after the sequence the producer published it with */
+	__sync_synchronize();
+	data = cell->data;
+	queue->head = pos + 1;
+	g_atomic_int_set(&cell->seq, pos + queue->mask + 1);
 
-	if (!queue->tail)
-		g_cond_wait(queue->condition, queue->mutex);
+	return data;
+}
 
-	if (queue->tail) {
-		GList *node = queue->tail;
-		data = node->data;
-
-		queue->tail = node->prev;
-		if (queue->tail)
-			queue->tail->next = NULL;
-		else
-			queue->head = NULL;
-		queue->length--;
-		g_list_free_1(node);
+void
+async_queue_push(AsyncQueue *queue,
+		 gpointer data)
+{
+	if (G_UNLIKELY(!try_push(queue, data))) {
+		g_critical("queue %p full", queue);
+		return;
 	}
 
-leave:
-	g_mutex_unlock(queue->mutex);
-
-	return data;
+	if (g_atomic_int_get(&queue->waiters)) {
+		g_mutex_lock(queue->mutex);
+		g_cond_signal(queue->condition);
+		g_mutex_unlock(queue->mutex);
+	}
 }
 
 gpointer
-async_queue_pop_forced(AsyncQueue *queue)
+async_queue_pop(AsyncQueue *queue)
 {
-	gpointer data = NULL;
+	gpointer data;
 
-	g_mutex_lock(queue->mutex);
+	if (!*(volatile gint *) &queue->enabled)
+		return NULL;
 
-	if (queue->tail) {
-		GList *node = queue->tail;
-		data = node->data;
-
-		queue->tail = node->prev;
-		if (queue->tail)
-			queue->tail->next = NULL;
-		else
-			queue->head = NULL;
-		queue->length--;
-		g_list_free_1(node);
-	}
+	data = try_pop(queue);
+	if (data)
+		return data;
 
+	g_mutex_lock(queue->mutex);
+	g_atomic_int_inc(&queue->waiters);
+	/* a push might have missed us */
+	data = try_pop(queue);
+	if (!data && g_atomic_int_get(&queue->enabled))
+		g_cond_wait(queue->condition, queue->mutex);
+	g_atomic_int_add(&queue->waiters, -1);
 	g_mutex_unlock(queue->mutex);
 
+	if (!data)
+		data = try_pop(queue);
+
 	return data;
 }
 
+gpointer
+async_queue_pop_forced(AsyncQueue *queue)
+{
+	return try_pop(queue);
+}
+
 void
 async_queue_disable(AsyncQueue *queue)
 {
 	g_mutex_lock(queue->mutex);
-	queue->enabled = FALSE;
+	g_atomic_int_set(&queue->enabled, FALSE);
 	g_cond_broadcast(queue->condition);
 	g_mutex_unlock(queue->mutex);
 }
@@ -121,17 +161,18 @@ async_queue_disable(AsyncQueue *queue)
 void
 async_queue_enable(AsyncQueue *queue)
 {
-	g_mutex_lock(queue->mutex);
-	queue->enabled = TRUE;
-	g_mutex_unlock(queue->mutex);
+	g_atomic_int_set(&queue->enabled, TRUE);
 }
 
 void
 async_queue_flush(AsyncQueue *queue)
 {
-	g_mutex_lock(queue->mutex);
-	g_list_free(queue->head);
-	queue->head = queue->tail = NULL;
-	queue->length = 0;
-	g_mutex_unlock(queue->mutex);
+	while (try_pop(queue));
+}
+
+/* only exact for the consumer; a hint for anybody else */
+guint
+async_queue_length(AsyncQueue *queue)
+{
+	return (guint) g_atomic_int_get(&queue->tail) - *(volatile guint *) &queue->head;
 }
@@ -15,16 +15,28 @@
 
 typedef struct AsyncQueue AsyncQueue;
 
+struct async_queue_cell {
+	gint seq;
+	gpointer data;
+};
+
+/*
+ * Bounded ring; push and pop don't allocate, and only take the mutex when
+ * somebody has to wait for an empty queue. Any thread can push, but only
+ * one can pop at a time.
+ */
 struct AsyncQueue {
 	GMutex *mutex;
 	GCond *condition;
-	GList *head;
-	GList *tail;
-	guint length;
-	gboolean enabled;
+	struct async_queue_cell *cells;
+	guint mask;
+	guint head; /* next to pop; the consumer's */
+	gint tail; /* next to push */
+	gint waiters;
+	gint enabled;
 };
 
-AsyncQueue *async_queue_new(void);
+AsyncQueue *async_queue_new(guint size);
 void async_queue_free(AsyncQueue *queue);
 void async_queue_push(AsyncQueue *queue, gpointer data);
 gpointer async_queue_pop(AsyncQueue *queue);
@@ -32,5 +44,6 @@ gpointer async_queue_pop_forced(AsyncQueue *queue);
 void async_queue_disable(AsyncQueue *queue);
 void async_queue_enable(AsyncQueue *queue);
 void async_queue_flush(AsyncQueue *queue);
+guint async_queue_length(AsyncQueue *queue);
 
 #endif /* ASYNC_QUEUE_H */
@@ -0,0 +1,291 @@
+/*
+ * Copyright (C) 2011 Felipe Contreras
+ *
+ * Author: Felipe Contreras <felipe.contreras@gmail.com>
+ *
+ * This file may be used under the terms of the GNU Lesser General Public
+ * License version 2.1, a copy of which is found in LICENSE included in the
+ * packaging of this file.
+ */
+
+/*
+ * GstDspBase on the bridge emulator (see README), so only the host side
+ * counts: frames pushed from memory through a dspvdec into a pad that
+ * drops them, and gstdsp_map_buffer() with its copy fallback. With 'pass'
+ * and no delay the frame time is the per-frame cost of pad_chain,
+ * send_buffer, the replies and output_loop. The events run sends an
+ * update NEWSEGMENT before every frame; those are the events that ride the
+ * timestamp ring, so the difference with the plain run is what the ring's
+ * event handling costs per frame. Output is one "<name> <value> <unit>"
+ * line per result.
+ */
+
+#include <gst/gst.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gstdspvdec.h"
+#include "dmm_buffer.h"
+#include "util.h"
+#include "log.h"
+
+#define FRAMES 2000
+#define FRAME_SIZE 4096
+
+GstDebugCategory *gstdsp_debug;
+
+static GMutex *mutex;
+static GCond *cond;
+static unsigned frames_out;
+static gboolean got_eos;
+
+/* an H.263 picture header of the given source format */
+static void
+fill_frame(guint8 *data,
+	   unsigned format)
+{
+	memset(data, 0, FRAME_SIZE);
+	data[2] = 0x80;
+	data[3] = 0x02;
+	data[4] = format << 2;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static GstFlowReturn
+sink_chain(GstPad *pad,
+	   GstBuffer *buf)
+{
+	frames_out++;
+	gst_buffer_unref(buf);
+	return GST_FLOW_OK;
+}
+
+static gboolean
+sink_event(GstPad *pad,
+	   GstEvent *event)
+{
+	if (GST_EVENT_TYPE(event) == GST_EVENT_EOS) {
+		g_mutex_lock(mutex);
+		got_eos = TRUE;
+		g_cond_signal(cond);
+		g_mutex_unlock(mutex);
+	}
+	gst_event_unref(event);
+	return TRUE;
+}
+
+static bool
+wait_eos(void)
+{
+	GTimeVal deadline;
+
+	g_get_current_time(&deadline);
+	g_time_val_add(&deadline, 10 * G_USEC_PER_SEC);
+
+	g_mutex_lock(mutex);
+	while (!got_eos)
+		if (!g_cond_timed_wait(cond, mutex, &deadline))
+			break;
+	g_mutex_unlock(mutex);
+
+	return got_eos;
+}
+
+/* frames per second through a dspvdec */
+static double
+run_vdec(const char *emulate,
+	 unsigned format,
+	 int width,
+	 int height,
+	 bool with_events)
+{
+	GstElement *dec;
+	GstPad *src, *sink, *pad;
+	GstCaps *caps;
+	guint8 *data;
+	double start, elapsed;
+	unsigned i;
+
+	setenv("GST_DSP_EMULATE", emulate, 1);
+
+	data = g_malloc(FRAME_SIZE);
+	fill_frame(data, format);
+
+	dec = g_object_new(GST_DSP_VDEC_TYPE, NULL);
+
+	src = gst_pad_new("src", GST_PAD_SRC);
+	sink = gst_pad_new("sink", GST_PAD_SINK);
+	gst_pad_set_chain_function(sink, sink_chain);
+	gst_pad_set_event_function(sink, sink_event);
+
+	pad = gst_element_get_static_pad(dec, "sink");
+	gst_pad_link(src, pad);
+	gst_object_unref(pad);
+	pad = gst_element_get_static_pad(dec, "src");
+	gst_pad_link(pad, sink);
+	gst_object_unref(pad);
+
+	gst_pad_set_active(src, TRUE);
+	gst_pad_set_active(sink, TRUE);
+
+	caps = gst_caps_new_simple("video/x-h263",
+				   "width", G_TYPE_INT, width,
+				   "height", G_TYPE_INT, height,
+				   "framerate", GST_TYPE_FRACTION, 30, 1,
+				   NULL);
+	gst_pad_set_caps(src, caps);
+
+	frames_out = 0;
+	got_eos = FALSE;
+
+	if (gst_element_set_state(dec, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+		fprintf(stderr, "couldn't start the decoder\n");
+		exit(1);
+	}
+
+	gst_pad_push_event(src, gst_event_new_new_segment(FALSE, 1.0, GST_FORMAT_TIME, 0, -1, 0));
+
+	start = now();
+	for (i = 0; i < FRAMES; i++) {
+		GstBuffer *buf = gst_buffer_new();
+
+		GST_BUFFER_DATA(buf) = data;
+		GST_BUFFER_SIZE(buf) = FRAME_SIZE;
+		GST_BUFFER_TIMESTAMP(buf) = i * GST_SECOND / 30;
+		GST_BUFFER_DURATION(buf) = GST_SECOND / 30;
+		gst_buffer_set_caps(buf, caps);
+
+		if (with_events)
+			gst_pad_push_event(src,
+					   gst_event_new_new_segment(TRUE, 1.0, GST_FORMAT_TIME,
+								     GST_BUFFER_TIMESTAMP(buf), -1,
+								     GST_BUFFER_TIMESTAMP(buf)));
+
+		if (gst_pad_push(src, buf) != GST_FLOW_OK) {
+			fprintf(stderr, "push failed at frame %u\n", i);
+			exit(1);
+		}
+	}
+	gst_pad_push_event(src, gst_event_new_eos());
+
+	if (!wait_eos() || frames_out != FRAMES) {
+		fprintf(stderr, "got %u of %u frames\n", frames_out, FRAMES);
+		exit(1);
+	}
+	elapsed = now() - start;
+
+	gst_element_set_state(dec, GST_STATE_NULL);
+	gst_object_unref(dec);
+	gst_object_unref(src);
+	gst_object_unref(sink);
+	gst_caps_unref(caps);
+	g_free(data);
+
+	return FRAMES * 1e9 / elapsed;
+}
+
+/* nanoseconds per map and unmap of a frame, copy included */
+static double
+run_map(int handle,
+	void *proc,
+	int dir,
+	size_t size,
+	unsigned offset,
+	unsigned rounds)
+{
+	GstBuffer *buf;
+	dmm_buffer_t *b;
+	guint8 *data;
+	double start, elapsed;
+	unsigned i;
+
+	if (posix_memalign((void **) &data, 4096, size + offset))
+		return 0;
+	memset(data, 0, size + offset);
+
+	buf = gst_buffer_new();
+	GST_BUFFER_DATA(buf) = data + offset;
+	GST_BUFFER_SIZE(buf) = size;
+
+	b = dmm_buffer_new(handle, proc, dir);
+
+	start = now();
+	for (i = 0; i < rounds; i++) {
+		if (gstdsp_map_buffer(NULL, buf, b))
+			gst_buffer_unref(buf);
+		else
+			memcpy(b->data, GST_BUFFER_DATA(buf), size);
+		dmm_buffer_map(b);
+		dmm_buffer_unmap(b);
+	}
+	elapsed = now() - start;
+
+	dmm_buffer_free(b);
+	gst_buffer_unref(buf);
+	free(data);
+
+	return elapsed / rounds;
+}
+
+int
+main(int argc, char *argv[])
+{
+	size_t frame = 1280 * 720 * 3 / 2;
+	void *proc;
+	int handle;
+	double fps, frame_ns;
+
+	gst_init(&argc, &argv);
+
+#ifndef GST_DISABLE_GST_DEBUG
+	gstdsp_debug = _gst_debug_category_new("dsp", 0, "DSP stuff");
+#endif
+	pr_init();
+
+	mutex = g_mutex_new();
+	cond = g_cond_new();
+
+	setenv("GST_DSP_EMULATE", "pass", 1);
+	handle = gstdsp_open(&proc);
+	if (handle < 0) {
+		fprintf(stderr, "couldn't open the emulator; is it built with DSP_EMU=1?\n");
+		return 1;
+	}
+
+	printf("map-in-720p %.0f ns\n",
+	       run_map(handle, proc, DMA_TO_DEVICE, frame, 0, 1000));
+	printf("map-out-720p-aligned %.0f ns\n",
+	       run_map(handle, proc, DMA_FROM_DEVICE, frame, 0, 1000));
+	/* warns every time, like the element would */
+	printf("map-out-720p-unaligned %.0f ns\n",
+	       run_map(handle, proc, DMA_FROM_DEVICE, frame, 4, 20));
+
+	gstdsp_close(handle, false);
+
+	fps = run_vdec("pass", 2, 176, 144, false);
+	printf("vdec-qcif-pass %.0f frames/s\n", fps);
+	frame_ns = 1e9 / fps;
+	printf("vdec-qcif-pass-frame %.0f ns\n", frame_ns);
+
+	fps = run_vdec("pass", 2, 176, 144, true);
+	printf("vdec-qcif-pass-events-frame %.0f ns\n", 1e9 / fps);
+	printf("vdec-qcif-ts-events %.0f ns\n", 1e9 / fps - frame_ns);
+
+	fps = run_vdec("echo", 3, 352, 288, false);
+	printf("vdec-cif-echo %.0f frames/s\n", fps);
+
+	g_cond_free(cond);
+	g_mutex_free(mutex);
+
+	return 0;
+}
@@ -29,22 +29,106 @@ enum dma_data_direction {
 	DMA_FROM_DEVICE,
 };
 
+struct dmm_cache_entry;
+struct dmm_slab;
+
+/* usage counters of a dsp handle; see dmm_stats.c */
+struct dmm_stats {
+	unsigned long maps; /* live mappings */
+	unsigned long mapped; /* bytes */
+	unsigned long peak_mapped;
+	unsigned long reserved; /* bytes of DSP virtual space */
+	unsigned long peak_reserved;
+	unsigned long reserve_calls;
+	unsigned long map_calls;
+	unsigned long copies; /* need_copy fallbacks */
+
+	int handle;
+	unsigned refcount;
+	struct dmm_stats *next;
+};
+
+struct dmm_stats *dmm_stats_new(int handle);
+struct dmm_stats *dmm_stats_get(int handle);
+void dmm_stats_put(struct dmm_stats *stats);
+void dmm_stats_unregister(struct dmm_stats *stats);
+
 typedef struct {
 	int handle;
 	void *proc;
 	void *data;
 	void *allocated_data;
+	size_t allocated_size;
+	bool frame; /* allocated_data comes from dmm_frame_alloc() */
 	size_t size;
 	size_t len;
 #if DSP_API >= 2
-	size_t dma_len;
+	size_t dma_start, dma_len;
 #endif
 	void *reserve;
 	void *map;
 	bool need_copy;
 	int dir;
+	struct dmm_cache_entry *cached; /* map borrowed from a dmm_cache */
+	struct dmm_slab *slab; /* chunk of a dmm_slab */
+	/* CPU writes since the last begin; only honored with track_dirty */
+	bool track_dirty;
+	size_t dirty_start, dirty_end;
+	bool no_cpu_access; /* output only goes to other hardware */
+	bool uncached; /* shared memory; no cache maintenance */
+	struct dmm_stats *stats;
+	size_t map_size, reserve_size; /* as accounted */
 } dmm_buffer_t;
 
+void dmm_slab_release(dmm_buffer_t *b);
+void dmm_cache_drop(dmm_buffer_t *b);
+void *dmm_frame_alloc(size_t *size);
+void dmm_frame_free(void *data, size_t size);
+
+static inline void
+dmm_stats_peak(unsigned long *peak,
+		unsigned long value)
+{
+	unsigned long old;
+
+	while ((old = *peak) < value)
+		if (__sync_bool_compare_and_swap(peak, old, value))
+			break;
+}
+
+/* negative sizes for unmap/unreserve */
+static inline void
+dmm_stats_map(struct dmm_stats *stats,
+		long size)
+{
+	if (!stats)
+		return;
+	if (size >= 0) {
+		__sync_fetch_and_add(&stats->map_calls, 1);
+		__sync_fetch_and_add(&stats->maps, 1);
+	} else
+		__sync_fetch_and_sub(&stats->maps, 1);
+	dmm_stats_peak(&stats->peak_mapped, __sync_add_and_fetch(&stats->mapped, size));
+}
+
+static inline void
+dmm_stats_reserve(struct dmm_stats *stats,
+		long size)
+{
+	if (!stats)
+		return;
+	if (size >= 0)
+		__sync_fetch_and_add(&stats->reserve_calls, 1);
+	dmm_stats_peak(&stats->peak_reserved, __sync_add_and_fetch(&stats->reserved, size));
+}
+
+static inline void
+dmm_stats_copy(struct dmm_stats *stats)
+{
+	if (stats)
+		__sync_fetch_and_add(&stats->copies, 1);
+}
+
 static inline dmm_buffer_t *
 dmm_buffer_new(int handle,
 		void *proc,
@@ -53,45 +137,118 @@ dmm_buffer_new(int handle,
 	dmm_buffer_t *b;
 	b = calloc(1, sizeof(*b));
 
-	pr_debug(NULL, "%p", b);
+	pr_cat_debug(LOG_DMM, NULL, "%p", b);
 	b->handle = handle;
 	b->proc = proc;
 	b->dir = dir;
+	b->stats = dmm_stats_get(handle);
 
 	return b;
 }
 
+static inline void
+dmm_buffer_release_data(dmm_buffer_t *b)
+{
+	if (b->frame)
+		dmm_frame_free(b->allocated_data, b->allocated_size);
+	else
+		free(b->allocated_data);
+	b->allocated_data = NULL;
+	b->frame = false;
+}
+
 static inline void
 dmm_buffer_free(dmm_buffer_t *b)
 {
-	pr_debug(NULL, "%p", b);
+	pr_cat_debug(LOG_DMM, NULL, "%p", b);
 	if (!b)
 		return;
-	if (b->map)
+	if (b->slab)
+		dmm_slab_release(b);
+	if (b->cached)
+		dmm_cache_drop(b);
+	if (b->map) {
 		dsp_unmap(b->handle, b->proc, b->map);
-	if (b->reserve)
+		dmm_stats_map(b->stats, -(long) b->map_size);
+	}
+	if (b->reserve) {
 		dsp_unreserve(b->handle, b->proc, b->reserve);
-	free(b->allocated_data);
+		dmm_stats_reserve(b->stats, -(long) b->reserve_size);
+	}
+	dmm_stats_put(b->stats);
+	dmm_buffer_release_data(b);
 	free(b);
 }
 
+/*
+ * Dirty tracking: owners that set track_dirty promise to report every CPU
+ * write with dmm_buffer_dirty(), so only those bytes are cleaned before the
+ * DSP reads them. Everything is dirty after the memory changes.
+ */
+static inline void
+dmm_buffer_dirty(dmm_buffer_t *b,
+		size_t offset,
+		size_t len)
+{
+	if (b->dirty_start >= b->dirty_end) {
+		b->dirty_start = offset;
+		b->dirty_end = offset + len;
+		return;
+	}
+	if (offset < b->dirty_start)
+		b->dirty_start = offset;
+	if (offset + len > b->dirty_end)
+		b->dirty_end = offset + len;
+}
+
+static inline void
+dmm_buffer_dirty_all(dmm_buffer_t *b)
+{
+	b->dirty_start = 0;
+	b->dirty_end = (size_t) -1;
+}
+
 static inline void
 dmm_buffer_begin(dmm_buffer_t *b,
 		size_t len)
 {
-	pr_debug(NULL, "%p", b);
-	if (len == 0)
+	size_t start = 0;
+
+	pr_cat_debug(LOG_DMM, NULL, "%p", b);
+
+	if (b->uncached)
+		return;
+
+	if (b->no_cpu_access && b->dir == DMA_FROM_DEVICE)
+		len = 0;
+	else if (b->track_dirty && b->dir == DMA_TO_DEVICE) {
+		start = b->dirty_start;
+		if (b->dirty_end < len)
+			len = b->dirty_end;
+		b->dirty_start = b->dirty_end = 0;
+	}
+
+	if (len <= start) {
+#if DSP_API >= 2
+		/* nothing to hand over, so nothing to take back */
+		if (b->dma_len != (size_t) -1)
+			b->dma_len = 0;
+#endif
 		return;
+	}
+	len -= start;
 #if DSP_API < 2
 	if (b->dir == DMA_FROM_DEVICE)
-		dsp_invalidate(b->handle, b->proc, b->data, len);
+		dsp_invalidate(b->handle, b->proc, (char *) b->data + start, len);
 	else
-		dsp_flush(b->handle, b->proc, b->data, len, 1);
+		dsp_flush(b->handle, b->proc, (char *) b->data + start, len, 1);
 #else
 	if (b->dma_len == (size_t) -1)
 		return;
-	if (dsp_begin_dma(b->handle, b->proc, b->data, len, b->dir))
+	if (dsp_begin_dma(b->handle, b->proc, (char *) b->data + start, len, b->dir)) {
+		b->dma_start = start;
 		b->dma_len = len;
+	}
 	else
 		b->dma_len = (size_t) -1;
 #endif
@@ -101,16 +258,20 @@ static inline void
 dmm_buffer_end(dmm_buffer_t *b,
 		size_t len)
 {
-	pr_debug(NULL, "%p", b);
-	if (len == 0)
+	pr_cat_debug(LOG_DMM, NULL, "%p", b);
+	if (b->uncached)
 		return;
 #if DSP_API < 2
-	if (b->dir != DMA_TO_DEVICE)
+	if (len == 0)
+		return;
+	if (b->dir != DMA_TO_DEVICE && !b->no_cpu_access)
 		dsp_invalidate(b->handle, b->proc, b->data, len);
 #else
-	if (b->dma_len == (size_t) -1)
+	/* the bridge wants the same range begin got */
+	if (b->dma_len == (size_t) -1 || b->dma_len == 0)
 		return;
-	dsp_end_dma(b->handle, b->proc, b->data, b->dma_len, b->dir);
+	dsp_end_dma(b->handle, b->proc, (char *) b->data + b->dma_start,
+			b->dma_len, b->dir);
 	b->dma_len = 0;
 #endif
 }
@@ -121,18 +282,34 @@ dmm_buffer_map(dmm_buffer_t *b)
 	size_t to_reserve;
 	unsigned long attr;
 
-	pr_debug(NULL, "%p", b);
+	pr_cat_debug(LOG_DMM, NULL, "%p", b);
 
-	if (b->map)
+	if (b->slab) {
+		/* always mapped; just flush what the CPU wrote */
+		dmm_buffer_begin(b, b->len);
+		return;
+	}
+	if (b->cached)
+		dmm_cache_drop(b);
+	if (b->map) {
 		dsp_unmap(b->handle, b->proc, b->map);
-	if (b->reserve)
+		dmm_stats_map(b->stats, -(long) b->map_size);
+		b->map = NULL;
+	}
+	if (b->reserve) {
 		dsp_unreserve(b->handle, b->proc, b->reserve);
+		dmm_stats_reserve(b->stats, -(long) b->reserve_size);
+		b->reserve = NULL;
+	}
 	/**
 	 * @todo What exactly do we want to do here? Shouldn't the driver
 	 * calculate this?
 	 */
 	to_reserve = ROUND_UP(b->size, PAGE_SIZE) + PAGE_SIZE;
-	dsp_reserve(b->handle, b->proc, to_reserve, &b->reserve);
+	if (dsp_reserve(b->handle, b->proc, to_reserve, &b->reserve)) {
+		b->reserve_size = to_reserve;
+		dmm_stats_reserve(b->stats, to_reserve);
+	}
 	switch (b->dir) {
 	case DMA_TO_DEVICE:
 		attr = DSP_IN_BUFFER; break;
@@ -143,19 +320,29 @@ dmm_buffer_map(dmm_buffer_t *b)
 	default:
 		attr = 0;
 	}
-	dsp_map(b->handle, b->proc, b->data, b->size, b->reserve, &b->map, attr);
+	if (dsp_map(b->handle, b->proc, b->data, b->size, b->reserve, &b->map, attr)) {
+		b->map_size = b->size;
+		dmm_stats_map(b->stats, b->size);
+	}
 }
 
 static inline void
 dmm_buffer_unmap(dmm_buffer_t *b)
 {
-	pr_debug(NULL, "%p", b);
+	pr_cat_debug(LOG_DMM, NULL, "%p", b);
+	if (b->slab)
+		return;
+	if (b->cached)
+		/* the cache owns the mapping */
+		dmm_cache_drop(b);
 	if (b->map) {
 		dsp_unmap(b->handle, b->proc, b->map);
+		dmm_stats_map(b->stats, -(long) b->map_size);
 		b->map = NULL;
 	}
 	if (b->reserve) {
 		dsp_unreserve(b->handle, b->proc, b->reserve);
+		dmm_stats_reserve(b->stats, -(long) b->reserve_size);
 		b->reserve = NULL;
 	}
 }
@@ -165,8 +352,10 @@ dmm_buffer_allocate(dmm_buffer_t *b,
 		size_t size)
 {
 	int alignment = b->dir == DMA_TO_DEVICE ? 0 : 128;
-	pr_debug(NULL, "%p", b);
-	free(b->allocated_data);
+	pr_cat_debug(LOG_DMM, NULL, "%p", b);
+	if (b->slab)
+		dmm_slab_release(b);
+	dmm_buffer_release_data(b);
 	if (alignment != 0) {
 		b->size = ROUND_UP(size, alignment);
 		if (posix_memalign(&b->allocated_data, alignment, b->size) != 0)
@@ -177,7 +366,77 @@ dmm_buffer_allocate(dmm_buffer_t *b,
 		b->size = size;
 		b->data = b->allocated_data = malloc(size);
 	}
+	b->allocated_size = b->allocated_data ? b->size : 0;
 	b->len = size;
+	dmm_buffer_dirty_all(b);
+}
+
+/*
+ * Full frames; the memory is pre-faulted, locked, and recycled across
+ * buffers. Don't hand it over to anything that would free() it.
+ */
+static inline void
+dmm_buffer_allocate_frame(dmm_buffer_t *b,
+		size_t size)
+{
+	size_t real_size = size;
+	void *data;
+
+	pr_cat_debug(LOG_DMM, NULL, "%p", b);
+	if (b->frame && b->allocated_size >= size)
+		goto done;
+	data = dmm_frame_alloc(&real_size);
+	if (!data) {
+		dmm_buffer_allocate(b, size);
+		return;
+	}
+	if (b->slab)
+		dmm_slab_release(b);
+	dmm_buffer_release_data(b);
+	b->allocated_data = data;
+	b->allocated_size = real_size;
+	b->frame = true;
+done:
+	b->data = b->allocated_data;
+	b->size = b->dir == DMA_TO_DEVICE ? size : ROUND_UP(size, 128);
+	b->len = size;
+	dmm_buffer_dirty_all(b);
+}
+
+/*
+ * Leave some room in front of the data, so the codec can add headers in
+ * place. The memory is reused if it's big enough.
+ */
+static inline void
+dmm_buffer_allocate_headroom(dmm_buffer_t *b,
+		size_t size,
+		size_t headroom)
+{
+	pr_cat_debug(LOG_DMM, NULL, "%p", b);
+	if (b->slab)
+		dmm_slab_release(b);
+	/* codecs might take this memory away and release it */
+	if (!b->allocated_data || b->frame || b->allocated_size < headroom + size) {
+		dmm_buffer_allocate(b, headroom + size);
+		if (!b->allocated_data)
+			return;
+	}
+	b->data = (char *) b->allocated_data + headroom;
+	b->len = b->size = size;
+	b->need_copy = true;
+	dmm_buffer_dirty_all(b);
+}
+
+/* how much room there is in front of the data, if it's our memory */
+static inline size_t
+dmm_buffer_headroom(dmm_buffer_t *b)
+{
+	char *start = b->allocated_data;
+	char *data = b->data;
+
+	if (!start || data < start || data >= start + b->allocated_size)
+		return 0;
+	return data - start;
 }
 
 static inline void
@@ -185,9 +444,11 @@ dmm_buffer_use(dmm_buffer_t *b,
 		void *data,
 		size_t size)
 {
-	pr_debug(NULL, "%p", b);
+	pr_cat_debug(LOG_DMM, NULL, "%p", b);
 	b->data = data;
 	b->len = b->size = size;
+	b->need_copy = false;
+	dmm_buffer_dirty_all(b);
 }
 
 static inline dmm_buffer_t *
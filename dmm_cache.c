@@ -0,0 +1,324 @@
+/*
+ * Copyright (C) 2011 Felipe Contreras
+ *
+ * Author: Felipe Contreras <felipe.contreras@gmail.com>
+ *
+ * This file may be used under the terms of the GNU Lesser General Public
+ * License version 2.1, a copy of which is found in LICENSE included in the
+ * packaging of this file.
+ */
+
+#define LOG_CATEGORY LOG_DMM
+
+#include "dmm_cache.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#define HASH_BITS 6
+#define HASH_SIZE (1 << HASH_BITS)
+
+struct dmm_cache_entry {
+	struct dmm_cache_entry *prev, *next;
+	struct dmm_cache_entry *hash_next;
+	struct dmm_cache *cache;
+	void *data;
+	size_t size;
+	int dir;
+	void *reserve;
+	size_t reserve_size;
+	void *map;
+	unsigned users;
+};
+
+struct dmm_cache {
+	int handle;
+	void *proc;
+	struct dmm_stats *stats;
+	pthread_mutex_t mutex;
+	size_t max_size;
+	size_t size;
+	/* most recently used first */
+	struct dmm_cache_entry *head, *tail;
+	/* by data pointer */
+	struct dmm_cache_entry *hash[HASH_SIZE];
+	unsigned users; /* of all the entries */
+	bool dead; /* freed, but buffers still hold entries */
+};
+
+struct dmm_cache *
+dmm_cache_new(int handle,
+	      void *proc,
+	      size_t max_size)
+{
+	struct dmm_cache *cache;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return NULL;
+
+	cache->handle = handle;
+	cache->proc = proc;
+	cache->max_size = max_size;
+	cache->stats = dmm_stats_get(handle);
+	pthread_mutex_init(&cache->mutex, NULL);
+
+	return cache;
+}
+
+static inline unsigned
+hash_index(void *data)
+{
+	return ((uint32_t) (uintptr_t) data * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static inline void
+unlink_entry(struct dmm_cache *cache,
+	     struct dmm_cache_entry *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		cache->head = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		cache->tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static inline void
+push_entry(struct dmm_cache *cache,
+	   struct dmm_cache_entry *e)
+{
+	e->next = cache->head;
+	if (cache->head)
+		cache->head->prev = e;
+	else
+		cache->tail = e;
+	cache->head = e;
+}
+
+static inline void
+hash_add(struct dmm_cache *cache,
+	 struct dmm_cache_entry *e)
+{
+	struct dmm_cache_entry **bucket = &cache->hash[hash_index(e->data)];
+
+	e->hash_next = *bucket;
+	*bucket = e;
+}
+
+static inline void
+hash_remove(struct dmm_cache *cache,
+	    struct dmm_cache_entry *e)
+{
+	struct dmm_cache_entry **p;
+
+	for (p = &cache->hash[hash_index(e->data)]; *p; p = &(*p)->hash_next) {
+		if (*p == e) {
+			*p = e->hash_next;
+			break;
+		}
+	}
+	e->hash_next = NULL;
+}
+
+static inline struct dmm_cache_entry *
+hash_find(struct dmm_cache *cache,
+	  dmm_buffer_t *b)
+{
+	struct dmm_cache_entry *e;
+
+	for (e = cache->hash[hash_index(b->data)]; e; e = e->hash_next)
+		if (e->data == b->data && e->size == b->size && e->dir == b->dir)
+			break;
+
+	return e;
+}
+
+static inline void
+unmap_entry(struct dmm_cache *cache,
+	    struct dmm_cache_entry *e)
+{
+	pr_debug(NULL, "unmapping %p(%zu)", e->data, e->size);
+	dsp_unmap(cache->handle, cache->proc, e->map);
+	dsp_unreserve(cache->handle, cache->proc, e->reserve);
+	dmm_stats_map(cache->stats, -(long) e->size);
+	dmm_stats_reserve(cache->stats, -(long) e->reserve_size);
+	cache->size -= e->size;
+	e->map = e->reserve = NULL;
+}
+
+static inline void
+destroy_entry(struct dmm_cache *cache,
+	      struct dmm_cache_entry *e)
+{
+	unlink_entry(cache, e);
+	hash_remove(cache, e);
+	unmap_entry(cache, e);
+	free(e);
+}
+
+/* drop the least recently used mappings nobody is using */
+static inline void
+evict(struct dmm_cache *cache)
+{
+	struct dmm_cache_entry *e, *prev;
+
+	for (e = cache->tail; e && cache->size > cache->max_size; e = prev) {
+		prev = e->prev;
+		if (e->users)
+			continue;
+		destroy_entry(cache, e);
+	}
+}
+
+static inline void
+destroy_cache(struct dmm_cache *cache)
+{
+	dmm_stats_put(cache->stats);
+	pthread_mutex_destroy(&cache->mutex);
+	free(cache);
+}
+
+/*
+ * Everything is unmapped right away, since the handle might go next; the
+ * entries buffers still hold are only freed when they give them back.
+ */
+void
+dmm_cache_free(struct dmm_cache *cache)
+{
+	struct dmm_cache_entry *e, *next;
+	bool done;
+
+	if (!cache)
+		return;
+
+	pthread_mutex_lock(&cache->mutex);
+
+	for (e = cache->head; e; e = next) {
+		next = e->next;
+		if (!e->users) {
+			destroy_entry(cache, e);
+			continue;
+		}
+		pr_warning(NULL, "mapping %p still in use", e->data);
+		unlink_entry(cache, e);
+		hash_remove(cache, e);
+		unmap_entry(cache, e);
+	}
+
+	cache->dead = true;
+	done = !cache->users;
+
+	pthread_mutex_unlock(&cache->mutex);
+
+	if (done)
+		destroy_cache(cache);
+}
+
+void
+dmm_cache_map(struct dmm_cache *cache,
+	      dmm_buffer_t *b)
+{
+	struct dmm_cache_entry *e;
+
+	/* whatever it had before */
+	dmm_buffer_unmap(b);
+
+	if (b->size > cache->max_size) {
+		dmm_buffer_map(b);
+		return;
+	}
+
+	pthread_mutex_lock(&cache->mutex);
+
+	e = hash_find(cache, b);
+	if (e) {
+		unlink_entry(cache, e);
+		push_entry(cache, e);
+		e->users++;
+		cache->users++;
+		pthread_mutex_unlock(&cache->mutex);
+
+		b->map = e->map;
+		b->cached = e;
+		/* the mapping is old, so the caches need maintenance */
+		dmm_buffer_begin(b, b->len);
+		return;
+	}
+
+	e = calloc(1, sizeof(*e));
+	if (!e) {
+		pthread_mutex_unlock(&cache->mutex);
+		dmm_buffer_map(b);
+		return;
+	}
+
+	dmm_buffer_map(b);
+	if (!b->map) {
+		pthread_mutex_unlock(&cache->mutex);
+		free(e);
+		return;
+	}
+
+	e->cache = cache;
+	e->data = b->data;
+	e->size = b->size;
+	e->dir = b->dir;
+	e->map = b->map;
+	e->reserve = b->reserve;
+	e->reserve_size = b->reserve_size;
+	e->users = 1;
+	cache->users++;
+	b->reserve = NULL;
+	b->map_size = b->reserve_size = 0;
+	b->cached = e;
+
+	push_entry(cache, e);
+	hash_add(cache, e);
+	cache->size += e->size;
+	evict(cache);
+
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+/* give the mapping back to the cache it's from */
+void
+dmm_cache_drop(dmm_buffer_t *b)
+{
+	struct dmm_cache_entry *e = b->cached;
+	struct dmm_cache *cache = e->cache;
+	bool done = false;
+
+	b->cached = NULL;
+	b->map = NULL;
+
+	pthread_mutex_lock(&cache->mutex);
+	e->users--;
+	cache->users--;
+	if (cache->dead) {
+		if (!e->users)
+			free(e);
+		done = !cache->users;
+	} else
+		evict(cache);
+	pthread_mutex_unlock(&cache->mutex);
+
+	if (done)
+		destroy_cache(cache);
+}
+
+void
+dmm_cache_release(struct dmm_cache *cache,
+		  dmm_buffer_t *b)
+{
+	if (!b->cached) {
+		dmm_buffer_unmap(b);
+		return;
+	}
+
+	dmm_buffer_end(b, b->len);
+	dmm_cache_drop(b);
+}
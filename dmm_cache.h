@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2011 Felipe Contreras
+ *
+ * Author: Felipe Contreras <felipe.contreras@gmail.com>
+ *
+ * This file may be used under the terms of the GNU Lesser General Public
+ * License version 2.1, a copy of which is found in LICENSE included in the
+ * packaging of this file.
+ */
+
+#ifndef DMM_CACHE_H
+#define DMM_CACHE_H
+
+#include "dmm_buffer.h"
+
+/*
+ * Keeps DSP mappings of foreign memory (e.g. GstBuffer data) alive after the
+ * DSP is done with them, so that when the same memory comes back, it doesn't
+ * need to be reserved and mapped again.
+ *
+ * The mappings are keyed by address, size and direction. Only use this when
+ * the memory is known to be recycled (e.g. v4l2src, or sinks with their own
+ * buffer pools), since a freed and re-allocated region might end up in the
+ * same address with different pages behind.
+ *
+ * A buffer holds its entry until it's released, unmapped, remapped, or
+ * freed; dmm_cache_free() unmaps everything, so it has to go before the
+ * handle is closed.
+ */
+
+struct dmm_cache;
+
+struct dmm_cache *dmm_cache_new(int handle, void *proc, size_t max_size);
+void dmm_cache_free(struct dmm_cache *cache);
+void dmm_cache_map(struct dmm_cache *cache, dmm_buffer_t *b);
+void dmm_cache_release(struct dmm_cache *cache, dmm_buffer_t *b);
+
+#endif /* DMM_CACHE_H */
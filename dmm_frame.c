@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2011 Felipe Contreras
+ *
+ * Author: Felipe Contreras <felipe.contreras@gmail.com>
+ *
+ * This file may be used under the terms of the GNU Lesser General Public
+ * License version 2.1, a copy of which is found in LICENSE included in the
+ * packaging of this file.
+ */
+
+#define LOG_CATEGORY LOG_DMM
+
+#include "dmm_buffer.h"
+
+#include <sys/mman.h>
+#include <pthread.h>
+
+/*
+ * Frames come from pre-faulted, locked mmap regions (huge pages when the
+ * kernel has them), so neither the first touch nor the DSP mapping has to
+ * fault pages in. Released regions are kept for the next frames, which
+ * usually have the same size.
+ */
+
+#define FRAME_MIN_SIZE 0x10000
+#define FRAME_GRANULE 0x10000
+#define HUGE_PAGE_SIZE 0x200000
+#define CACHE_MAX_SIZE 0x2000000
+
+struct region {
+	struct region *next;
+	void *data;
+	size_t size;
+};
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct region *free_list; /* most recently released first */
+static size_t cached_size;
+static bool no_huge_pages;
+
+static inline void *
+map_region(size_t size)
+{
+	void *data;
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE;
+
+#ifdef MAP_HUGETLB
+	if (!no_huge_pages && size % HUGE_PAGE_SIZE == 0) {
+		data = mmap(NULL, size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB | MAP_LOCKED, -1, 0);
+		if (data != MAP_FAILED)
+			return data;
+		pr_debug(NULL, "no huge pages");
+		no_huge_pages = true;
+	}
+#endif
+
+	data = mmap(NULL, size, PROT_READ | PROT_WRITE, flags | MAP_LOCKED, -1, 0);
+	if (data != MAP_FAILED)
+		return data;
+
+	/* probably over RLIMIT_MEMLOCK */
+	data = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (data != MAP_FAILED)
+		return data;
+
+	return NULL;
+}
+
+void *
+dmm_frame_alloc(size_t *size)
+{
+	struct region *r, **p;
+	size_t real_size;
+	void *data;
+
+	if (*size < FRAME_MIN_SIZE)
+		return NULL;
+
+	if (!no_huge_pages && *size >= HUGE_PAGE_SIZE)
+		real_size = ROUND_UP(*size, HUGE_PAGE_SIZE);
+	else
+		real_size = ROUND_UP(*size, FRAME_GRANULE);
+
+	pthread_mutex_lock(&mutex);
+	for (p = &free_list; (r = *p); p = &r->next) {
+		if (r->size >= *size && r->size <= real_size) {
+			*p = r->next;
+			cached_size -= r->size;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+
+	if (r) {
+		data = r->data;
+		*size = r->size;
+		free(r);
+		return data;
+	}
+
+	data = map_region(real_size);
+	if (!data)
+		return NULL;
+
+	pr_debug(NULL, "new frame region %p(%zu)", data, real_size);
+	*size = real_size;
+	return data;
+}
+
+void
+dmm_frame_free(void *data,
+	       size_t size)
+{
+	struct region *r, **p, *evicted = NULL;
+
+	if (!data)
+		return;
+
+	r = calloc(1, sizeof(*r));
+	if (!r || size > CACHE_MAX_SIZE) {
+		free(r);
+		munmap(data, size);
+		return;
+	}
+
+	r->data = data;
+	r->size = size;
+
+	pthread_mutex_lock(&mutex);
+	r->next = free_list;
+	free_list = r;
+	cached_size += size;
+
+	/* drop the oldest ones */
+	if (cached_size > CACHE_MAX_SIZE) {
+		size_t total = 0;
+		for (p = &free_list; *p; p = &(*p)->next) {
+			total += (*p)->size;
+			if (total > CACHE_MAX_SIZE)
+				break;
+		}
+		evicted = *p;
+		*p = NULL;
+		for (r = evicted; r; r = r->next)
+			cached_size -= r->size;
+	}
+	pthread_mutex_unlock(&mutex);
+
+	while (evicted) {
+		r = evicted->next;
+		munmap(evicted->data, evicted->size);
+		free(evicted);
+		evicted = r;
+	}
+}
@@ -0,0 +1,292 @@
+/*
+ * Copyright (C) 2011 Felipe Contreras
+ *
+ * Author: Felipe Contreras <felipe.contreras@gmail.com>
+ *
+ * This file may be used under the terms of the GNU Lesser General Public
+ * License version 2.1, a copy of which is found in LICENSE included in the
+ * packaging of this file.
+ */
+
+#define LOG_CATEGORY LOG_DMM
+
+#include "dmm_slab.h"
+
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * Chunks must not share cache lines, otherwise the maintenance of one would
+ * clobber the other.
+ */
+#define CHUNK_SIZE 128
+#define REGION_SIZE PAGE_SIZE
+#define CHUNKS_PER_REGION (REGION_SIZE / CHUNK_SIZE)
+
+struct region {
+	struct region *next;
+	dmm_buffer_t *buf;
+	uint32_t used; /* one bit per chunk */
+	bool shm; /* from the node's part of the CMM segment */
+};
+
+struct dmm_slab {
+	int handle;
+	void *proc;
+	pthread_mutex_t mutex;
+	struct region *regions;
+	struct dsp_node *node; /* take new regions from its shared memory */
+	struct dsp_node *shm_node; /* the one the shared regions came from */
+};
+
+struct dmm_slab *
+dmm_slab_new(int handle,
+	     void *proc)
+{
+	struct dmm_slab *slab;
+
+	slab = calloc(1, sizeof(*slab));
+	if (!slab)
+		return NULL;
+
+	slab->handle = handle;
+	slab->proc = proc;
+	pthread_mutex_init(&slab->mutex, NULL);
+
+	return slab;
+}
+
+bool
+dmm_slab_use_shm(struct dmm_slab *slab,
+		 struct dsp_node *node)
+{
+	pthread_mutex_lock(&slab->mutex);
+	if (node && !node->msgbuf_addr)
+		node = NULL;
+	if (node && slab->shm_node && slab->shm_node != node) {
+		pr_warning(NULL, "shared regions of another node still around");
+		node = NULL;
+	}
+	slab->node = node;
+	if (node)
+		slab->shm_node = node;
+	pthread_mutex_unlock(&slab->mutex);
+
+	return node != NULL;
+}
+
+static inline void
+free_region(struct dmm_slab *slab,
+	    struct region *r)
+{
+	if (r->used)
+		pr_warning(NULL, "region %p still in use: 0x%08x", r->buf->data, r->used);
+	if (r->shm) {
+		dsp_node_shm_free(slab->handle, slab->shm_node, r->buf->data);
+		r->buf->map = NULL;
+		r->buf->data = NULL;
+	}
+	dmm_buffer_free(r->buf);
+	free(r);
+}
+
+void
+dmm_slab_drop_shm(struct dmm_slab *slab)
+{
+	struct region **p, *r;
+
+	if (!slab)
+		return;
+
+	pthread_mutex_lock(&slab->mutex);
+	p = &slab->regions;
+	while ((r = *p)) {
+		if (!r->shm) {
+			p = &r->next;
+			continue;
+		}
+		*p = r->next;
+		free_region(slab, r);
+	}
+	slab->node = NULL;
+	slab->shm_node = NULL;
+	pthread_mutex_unlock(&slab->mutex);
+}
+
+void
+dmm_slab_free(struct dmm_slab *slab)
+{
+	struct region *r, *next;
+
+	if (!slab)
+		return;
+
+	dmm_slab_drop_shm(slab);
+
+	for (r = slab->regions; r; r = next) {
+		next = r->next;
+		free_region(slab, r);
+	}
+
+	pthread_mutex_destroy(&slab->mutex);
+	free(slab);
+}
+
+/* memory already shared with the DSP: no map, no cache maintenance */
+static inline bool
+shm_region(struct dmm_slab *slab,
+	   struct region *r)
+{
+	void *addr;
+	unsigned long dsp_addr;
+
+	if (!dsp_node_shm_alloc(slab->handle, slab->node, REGION_SIZE, &addr, &dsp_addr)) {
+		/* the segment is full; don't ask again */
+		slab->node = NULL;
+		return false;
+	}
+
+	r->shm = true;
+	r->buf->size = r->buf->len = REGION_SIZE;
+	r->buf->data = addr;
+	r->buf->map = (void *) dsp_addr;
+	r->buf->uncached = true;
+
+	pr_debug(NULL, "new shared region %p", r->buf->data);
+	return true;
+}
+
+static inline struct region *
+new_region(struct dmm_slab *slab)
+{
+	struct region *r;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+
+	r->buf = dmm_buffer_new(slab->handle, slab->proc, DMA_BIDIRECTIONAL);
+	if (slab->node && shm_region(slab, r))
+		return r;
+
+	r->buf->size = REGION_SIZE;
+	if (posix_memalign(&r->buf->allocated_data, PAGE_SIZE, REGION_SIZE) != 0) {
+		free(r->buf);
+		free(r);
+		return NULL;
+	}
+	r->buf->data = r->buf->allocated_data;
+	r->buf->len = REGION_SIZE;
+	dmm_buffer_map(r->buf);
+	if (!r->buf->map) {
+		dmm_buffer_free(r->buf);
+		free(r);
+		return NULL;
+	}
+
+	pr_debug(NULL, "new region %p", r->buf->data);
+	return r;
+}
+
+/* find room for count consecutive chunks */
+static inline int
+find_chunks(struct region *r,
+	    unsigned count)
+{
+	uint32_t mask;
+	unsigned i;
+
+	mask = count >= 32 ? ~0U : (1U << count) - 1;
+	for (i = 0; i + count <= CHUNKS_PER_REGION; i++)
+		if (!(r->used & (mask << i)))
+			return i;
+	return -1;
+}
+
+dmm_buffer_t *
+dmm_slab_calloc(struct dmm_slab *slab,
+		size_t size,
+		int dir)
+{
+	dmm_buffer_t *b;
+	struct region *r;
+	unsigned count;
+	uint32_t mask;
+	int idx = -1;
+
+	if (size == 0 || size > REGION_SIZE)
+		goto fallback;
+
+	count = ROUND_UP(size, CHUNK_SIZE) / CHUNK_SIZE;
+	mask = count >= 32 ? ~0U : (1U << count) - 1;
+
+	pthread_mutex_lock(&slab->mutex);
+
+	for (r = slab->regions; r; r = r->next) {
+		/* shared regions only while asked for, they go with the node */
+		if (r->shm != (slab->node != NULL))
+			continue;
+		idx = find_chunks(r, count);
+		if (idx >= 0)
+			break;
+	}
+
+	if (!r) {
+		r = new_region(slab);
+		if (!r) {
+			pthread_mutex_unlock(&slab->mutex);
+			goto fallback;
+		}
+		r->next = slab->regions;
+		slab->regions = r;
+		idx = 0;
+	}
+
+	r->used |= mask << idx;
+
+	pthread_mutex_unlock(&slab->mutex);
+
+	b = dmm_buffer_new(slab->handle, slab->proc, dir);
+	b->slab = slab;
+	b->data = (char *) r->buf->data + idx * CHUNK_SIZE;
+	b->map = (char *) r->buf->map + idx * CHUNK_SIZE;
+	b->size = count * CHUNK_SIZE;
+	b->len = size;
+	b->uncached = r->buf->uncached;
+	memset(b->data, 0, size);
+
+	return b;
+
+fallback:
+	return dmm_buffer_calloc(slab->handle, slab->proc, size, dir);
+}
+
+void
+dmm_slab_release(dmm_buffer_t *b)
+{
+	struct dmm_slab *slab = b->slab;
+	struct region *r;
+
+	pthread_mutex_lock(&slab->mutex);
+
+	for (r = slab->regions; r; r = r->next) {
+		size_t offset = (char *) b->data - (char *) r->buf->data;
+		unsigned count, idx;
+		uint32_t mask;
+
+		if ((char *) b->data < (char *) r->buf->data || offset >= REGION_SIZE)
+			continue;
+
+		idx = offset / CHUNK_SIZE;
+		count = b->size / CHUNK_SIZE;
+		mask = count >= 32 ? ~0U : (1U << count) - 1;
+		r->used &= ~(mask << idx);
+		break;
+	}
+
+	pthread_mutex_unlock(&slab->mutex);
+
+	b->slab = NULL;
+	b->data = NULL;
+	b->map = NULL;
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2011 Felipe Contreras
+ *
+ * Author: Felipe Contreras <felipe.contreras@gmail.com>
+ *
+ * This file may be used under the terms of the GNU Lesser General Public
+ * License version 2.1, a copy of which is found in LICENSE included in the
+ * packaging of this file.
+ */
+
+#ifndef DMM_SLAB_H
+#define DMM_SLAB_H
+
+#include "dmm_buffer.h"
+
+/*
+ * Small DSP buffers (messages, params) carved out of shared pages that are
+ * mapped only once. The returned dmm_buffer_t has both the MPU pointer
+ * (data) and the DSP address (map) already set; dmm_buffer_map() and
+ * dmm_buffer_unmap() are no-ops on them, and dmm_buffer_free() gives the
+ * chunk back.
+ */
+
+struct dmm_slab;
+
+struct dmm_slab *dmm_slab_new(int handle, void *proc);
+/*
+ * Until called again with NULL, allocate from the node's part of the CMM
+ * shared memory segment; those chunks must be freed, and then
+ * dmm_slab_drop_shm() called, before the node is.
+ */
+bool dmm_slab_use_shm(struct dmm_slab *slab, struct dsp_node *node);
+void dmm_slab_drop_shm(struct dmm_slab *slab);
+void dmm_slab_free(struct dmm_slab *slab);
+dmm_buffer_t *dmm_slab_calloc(struct dmm_slab *slab, size_t size, int dir);
+
+#endif /* DMM_SLAB_H */
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2011 Felipe Contreras
+ *
+ * Author: Felipe Contreras <felipe.contreras@gmail.com>
+ *
+ * This file may be used under the terms of the GNU Lesser General Public
+ * License version 2.1, a copy of which is found in LICENSE included in the
+ * packaging of this file.
+ */
+
+#define LOG_CATEGORY LOG_DMM
+
+#include "dmm_buffer.h"
+
+#include <pthread.h>
+
+/*
+ * Each element opens its own dsp handle, so buffers find their counters by
+ * handle when they are created, and keep a reference, since they might
+ * outlive the element (e.g. pooled buffers still downstream). The list
+ * itself holds no reference; the owner unregisters before closing the
+ * handle, and drops its reference whenever it's done reading.
+ */
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct dmm_stats *list;
+
+struct dmm_stats *
+dmm_stats_new(int handle)
+{
+	struct dmm_stats *stats;
+
+	stats = calloc(1, sizeof(*stats));
+	if (!stats)
+		return NULL;
+
+	stats->handle = handle;
+	stats->refcount = 1;
+
+	pthread_mutex_lock(&mutex);
+	stats->next = list;
+	list = stats;
+	pthread_mutex_unlock(&mutex);
+
+	return stats;
+}
+
+struct dmm_stats *
+dmm_stats_get(int handle)
+{
+	struct dmm_stats *stats;
+
+	pthread_mutex_lock(&mutex);
+	for (stats = list; stats; stats = stats->next)
+		if (stats->handle == handle)
+			break;
+	if (stats)
+		__sync_fetch_and_add(&stats->refcount, 1);
+	pthread_mutex_unlock(&mutex);
+
+	return stats;
+}
+
+void
+dmm_stats_put(struct dmm_stats *stats)
+{
+	if (!stats)
+		return;
+	if (__sync_sub_and_fetch(&stats->refcount, 1) == 0)
+		free(stats);
+}
+
+void
+dmm_stats_unregister(struct dmm_stats *stats)
+{
+	struct dmm_stats **p;
+
+	if (!stats)
+		return;
+
+	pthread_mutex_lock(&mutex);
+	for (p = &list; *p; p = &(*p)->next) {
+		if (*p == stats) {
+			*p = stats->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+}
@@ -23,6 +23,7 @@
 
 #include <malloc.h> /* for memalign */
 #include <string.h> /* for memset */
+#include <time.h> /* for clock_gettime */
 
 #define ALLOCATE_SM
 
@@ -31,7 +32,7 @@
 #include <sys/mman.h> /* for mmap */
 #endif
 
-#if DSP_API < 2
+#if DSP_API < 2 || defined(DSP_EMU)
 #include <errno.h>
 #endif
 
@@ -129,6 +130,7 @@
 #define NODE_DELETE		_IOW(DB, DB_IOC(DB_NODE, 5), unsigned long)
 #define NODE_GETATTR		_IOWR(DB, DB_IOC(DB_NODE, 7), unsigned long)
 #define NODE_ALLOCMSGBUF	_IOWR(DB, DB_IOC(DB_NODE, 1), unsigned long)
+#define NODE_FREEMSGBUF		_IOW(DB, DB_IOC(DB_NODE, 6), unsigned long)
 #define NODE_GETUUIDPROPS	_IOWR(DB, DB_IOC(DB_NODE, 14), unsigned long)
 #define NODE_ALLOCATE		_IOWR(DB, DB_IOC(DB_NODE, 0), unsigned long)
 #define NODE_CONNECT		_IOW(DB, DB_IOC(DB_NODE, 3), unsigned long)
@@ -147,18 +149,178 @@
 #define STRM_FREEBUFFER		_IOWR(DB, DB_IOC(DB_STRM, 2), unsigned long)
 #define STRM_ISSUE		_IOW(DB, DB_IOC(DB_STRM, 6), unsigned long)
 
+#ifdef DSP_EMU
+static bool emulating;
+static int emu_ioctl(int fd, unsigned long r, void *arg);
+static bool emu_setup(const char *config);
+
+static inline int raw_ioctl(int fd, unsigned long r, void *arg)
+{
+	if (emulating)
+		return emu_ioctl(fd, r, arg);
+	return ioctl(fd, r, arg);
+}
+#else
+#define raw_ioctl ioctl
+#endif
+
 #if DSP_API < 2
 static inline int real_ioctl(int fd, int r, void *arg)
 {
-	return ioctl(fd, r, arg);
+	return raw_ioctl(fd, r, arg);
 }
 #endif
 
+#if DSP_API >= 1
+#define IOC_NR(r) _IOC_NR(r)
+#else
+#define IOC_NR(r) (r)
+#endif
+
+#define STAT(r, n) [IOC_NR(r)] = { .name = n }
+
+static struct dsp_ioctl_stats ioctl_stats[DSP_IOCTL_MAX] = {
+	STAT(MGR_WAIT, "mgr-wait"),
+	STAT(MGR_ENUMNODE_INFO, "mgr-enumnode-info"),
+	STAT(MGR_REGISTEROBJECT, "mgr-registerobject"),
+	STAT(MGR_UNREGISTEROBJECT, "mgr-unregisterobject"),
+	STAT(PROC_ATTACH, "proc-attach"),
+	STAT(PROC_DETACH, "proc-detach"),
+	STAT(PROC_REGISTERNOTIFY, "proc-registernotify"),
+	STAT(PROC_RSVMEM, "proc-rsvmem"),
+	STAT(PROC_UNRSVMEM, "proc-unrsvmem"),
+	STAT(PROC_MAPMEM, "proc-mapmem"),
+	STAT(PROC_UNMAPMEM, "proc-unmapmem"),
+	STAT(PROC_FLUSHMEMORY, "proc-flushmemory"),
+	STAT(PROC_INVALIDATEMEMORY, "proc-invalidatememory"),
+	STAT(PROC_GET_STATE, "proc-get-state"),
+	STAT(PROC_ENUMRESOURCES, "proc-enumresources"),
+	STAT(PROC_ENUMNODE, "proc-enumnode"),
+	STAT(PROC_STOP, "proc-stop"),
+	STAT(PROC_LOAD, "proc-load"),
+	STAT(PROC_START, "proc-start"),
+#if DSP_API >= 1
+	/* the old numbers run into the node ones */
+	STAT(PROC_BEGINDMA, "proc-begindma"),
+	STAT(PROC_ENDDMA, "proc-enddma"),
+#endif
+	STAT(NODE_REGISTERNOTIFY, "node-registernotify"),
+	STAT(NODE_CREATE, "node-create"),
+	STAT(NODE_RUN, "node-run"),
+	STAT(NODE_TERMINATE, "node-terminate"),
+	STAT(NODE_PUTMESSAGE, "node-putmessage"),
+	STAT(NODE_GETMESSAGE, "node-getmessage"),
+	STAT(NODE_DELETE, "node-delete"),
+	STAT(NODE_GETATTR, "node-getattr"),
+	STAT(NODE_ALLOCMSGBUF, "node-allocmsgbuf"),
+	STAT(NODE_FREEMSGBUF, "node-freemsgbuf"),
+	STAT(NODE_GETUUIDPROPS, "node-getuuidprops"),
+	STAT(NODE_ALLOCATE, "node-allocate"),
+	STAT(NODE_CONNECT, "node-connect"),
+	STAT(CMM_GETHANDLE, "cmm-gethandle"),
+	STAT(CMM_GETINFO, "cmm-getinfo"),
+	STAT(STRM_OPEN, "strm-open"),
+	STAT(STRM_CLOSE, "strm-close"),
+	STAT(STRM_GETINFO, "strm-getinfo"),
+	STAT(STRM_ALLOCATEBUFFER, "strm-allocatebuffer"),
+	STAT(STRM_IDLE, "strm-idle"),
+	STAT(STRM_RECLAIM, "strm-reclaim"),
+	STAT(STRM_FREEBUFFER, "strm-freebuffer"),
+	STAT(STRM_ISSUE, "strm-issue"),
+};
+
+#undef STAT
+
+bool dsp_ioctl_stats_enabled;
+
+static const uint64_t bucket_limits[DSP_IOCTL_BUCKETS - 1] = {
+	10000, 30000, 100000, 300000, 1000000, 3000000, 10000000,
+};
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* several threads call in; the maximum might miss a close race */
+static inline void account(unsigned nr, uint64_t time, bool failed)
+{
+	struct dsp_ioctl_stats *s = &ioctl_stats[nr & (DSP_IOCTL_MAX - 1)];
+	unsigned i;
+
+	for (i = 0; i < DSP_IOCTL_BUCKETS - 1; i++)
+		if (time < bucket_limits[i])
+			break;
+
+	__sync_fetch_and_add(&s->calls, 1);
+	__sync_fetch_and_add(&s->histogram[i], 1);
+	__sync_fetch_and_add(&s->time, time);
+	if (failed)
+		__sync_fetch_and_add(&s->errors, 1);
+	if (time > s->max_time)
+		s->max_time = time;
+}
+
+static inline int timed_ioctl(int fd, unsigned long r, void *arg)
+{
+	uint64_t start;
+	int ret;
+
+	if (!dsp_ioctl_stats_enabled)
+		return raw_ioctl(fd, r, arg);
+
+	start = now_ns();
+	ret = raw_ioctl(fd, r, arg);
+	account(IOC_NR(r), now_ns() - start, ret < 0);
+
+	return ret;
+}
+
+void dsp_ioctl_stats_enable(bool enable)
+{
+	dsp_ioctl_stats_enabled = enable;
+}
+
+void dsp_ioctl_stats_reset(void)
+{
+	unsigned i;
+
+	for (i = 0; i < DSP_IOCTL_MAX; i++) {
+		struct dsp_ioctl_stats *s = &ioctl_stats[i];
+		const char *name = s->name;
+
+		memset(s, 0, sizeof(*s));
+		s->name = name;
+	}
+}
+
+const struct dsp_ioctl_stats *dsp_ioctl_stats_get(void)
+{
+	return ioctl_stats;
+}
+
 /* will not be needed when tidspbridge uses proper error codes */
-#define ioctl(...) (ioctl(__VA_ARGS__) < 0)
+#define ioctl(fd, r, arg) (timed_ioctl(fd, r, arg) < 0)
 
 int dsp_open(void)
 {
+	if (getenv("GST_DSP_IOCTL_STATS"))
+		dsp_ioctl_stats_enabled = true;
+
+#ifdef DSP_EMU
+	if (getenv("GST_DSP_EMULATE")) {
+		if (!emu_setup(getenv("GST_DSP_EMULATE"))) {
+			errno = EINVAL;
+			return -1;
+		}
+		/* a real descriptor, so dsp_close() works */
+		return open("/dev/null", O_RDWR);
+	}
+#endif
+
 	return open("/dev/DspBridge", O_RDWR);
 }
 
@@ -453,6 +615,22 @@ bool dsp_node_put_message(int handle,
 	return !ioctl(handle, NODE_PUTMESSAGE, &arg);
 }
 
+bool dsp_msg_batch_flush(struct dsp_msg_batch *batch)
+{
+	bool ret = true;
+	unsigned i;
+
+	for (i = 0; i < batch->count; i++) {
+		if (!dsp_node_put_message(batch->handle, batch->node, &batch->msgs[i], -1)) {
+			ret = false;
+			break;
+		}
+	}
+	batch->count = 0;
+
+	return ret;
+}
+
 struct node_get_message {
 	void *node_handle;
 	struct dsp_msg *message;
@@ -645,6 +823,7 @@ static inline bool allocate_segments(int handle,
 
 			node->msgbuf_addr = base;
 			node->msgbuf_size = seg->size;
+			node->msgbuf_dsp_addr = seg->dsp_base_va;
 		}
 	}
 
@@ -803,6 +982,66 @@ bool dsp_node_free(int handle,
 	return true;
 }
 
+#ifdef ALLOCATE_SM
+struct node_free_buf {
+	void *node_handle;
+	struct dsp_buffer_attr *attr;
+	void *buffer;
+};
+#endif
+
+bool dsp_node_shm_alloc(int handle,
+		struct dsp_node *node,
+		size_t size,
+		void **addr,
+		unsigned long *dsp_addr)
+{
+#ifdef ALLOCATE_SM
+	struct dsp_buffer_attr attr = { .cb = 0, .segment = 1, .alignment = 0 };
+	void *buf = NULL;
+	size_t offset;
+
+	if (!node->msgbuf_addr)
+		return false;
+
+	if (!dsp_node_alloc_buf(handle, node, size, &attr, &buf))
+		return false;
+
+	offset = (char *) buf - (char *) node->msgbuf_addr;
+	if ((char *) buf < (char *) node->msgbuf_addr ||
+			offset + size > node->msgbuf_size)
+	{
+		dsp_node_shm_free(handle, node, buf);
+		return false;
+	}
+
+	*addr = buf;
+	*dsp_addr = node->msgbuf_dsp_addr + offset;
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool dsp_node_shm_free(int handle,
+		struct dsp_node *node,
+		void *addr)
+{
+#ifdef ALLOCATE_SM
+	struct dsp_buffer_attr attr = { .cb = 0, .segment = 1, .alignment = 0 };
+	struct node_free_buf arg = {
+		.node_handle = node->handle,
+		.attr = &attr,
+		.buffer = addr,
+	};
+
+	return !ioctl(handle, NODE_FREEMSGBUF, &arg);
+#else
+	return false;
+#endif
+}
+
 struct reserve_mem {
 	void *proc_handle;
 	unsigned long size;
@@ -1278,3 +1517,586 @@ bool dsp_stream_free_buffers(int handle,
 
 	return true;
 }
+
+#ifdef DSP_EMU
+
+/*
+ * An in-process stand-in for the bridge driver and the socket nodes, so
+ * the host side can run on any box: GST_DSP_EMULATE=<mode>[:<delay in us>].
+ * Each input buffer is paired with the next output buffer, and both go
+ * back after the delay; "pass" only sets the output length, "echo" copies
+ * the input, and "invert" copies it inverted. There's no shared memory
+ * segment, and a buffer the host didn't map is an MMU fault.
+ *
+ * The socket node ABI carries pointers in 32 bits, so the host side needs
+ * a 32-bit build.
+ */
+
+#include <pthread.h>
+#include <stdio.h> /* for sscanf */
+
+#define EMU_QUEUE 64
+#define EMU_DSP_START 0x20000000
+#define EMU_DSP_END 0xf0000000
+
+enum emu_mode {
+	EMU_PASS,
+	EMU_ECHO,
+	EMU_INVERT,
+};
+
+struct emu_ring {
+	unsigned head, tail; /* free-running */
+	struct dsp_msg msgs[EMU_QUEUE];
+};
+
+/* the start of dsp_comm_t, as the node sees it */
+struct emu_comm {
+	uint32_t buffer_data;
+	uint32_t buffer_size;
+	uint32_t param_data;
+	uint32_t param_size;
+	uint32_t buffer_len;
+};
+
+struct emu_node;
+
+struct emu_event {
+	unsigned int mask;
+	struct emu_node *node; /* message ready */
+	bool pending;
+	struct emu_event *next;
+};
+
+struct emu_node {
+	pthread_t thread;
+	pthread_cond_t cond;
+	bool running, quit;
+	struct emu_ring in, out;
+	struct emu_ring inputs, outputs; /* buffers waiting for a pair */
+	struct emu_event *event;
+};
+
+struct emu_area {
+	uint32_t start;
+	unsigned long size;
+	uint32_t map; /* 0 when not mapped */
+	unsigned long map_size;
+	void *mpu;
+};
+
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond; /* for MGR_WAIT and NODE_GETMESSAGE */
+	enum emu_mode mode;
+	unsigned delay; /* us */
+	struct emu_event *proc_events;
+	struct emu_area *areas;
+	unsigned nr_areas, max_areas;
+	uint32_t next_start;
+} emu = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.next_start = EMU_DSP_START,
+};
+
+static bool emu_setup(const char *config)
+{
+	char mode[16];
+	unsigned delay = 0;
+
+	if (sscanf(config, "%15[a-z]:%u", mode, &delay) < 1)
+		return false;
+
+	if (strcmp(mode, "pass") == 0)
+		emu.mode = EMU_PASS;
+	else if (strcmp(mode, "echo") == 0)
+		emu.mode = EMU_ECHO;
+	else if (strcmp(mode, "invert") == 0)
+		emu.mode = EMU_INVERT;
+	else
+		return false;
+
+	emu.delay = delay;
+	emulating = true;
+
+	return true;
+}
+
+static inline bool emu_ring_empty(struct emu_ring *ring)
+{
+	return ring->head == ring->tail;
+}
+
+static inline bool emu_ring_push(struct emu_ring *ring,
+		const struct dsp_msg *msg)
+{
+	if (ring->head - ring->tail == EMU_QUEUE)
+		return false;
+	ring->msgs[ring->head++ % EMU_QUEUE] = *msg;
+	return true;
+}
+
+static inline bool emu_ring_pop(struct emu_ring *ring,
+		struct dsp_msg *msg)
+{
+	if (emu_ring_empty(ring))
+		return false;
+	*msg = ring->msgs[ring->tail++ % EMU_QUEUE];
+	return true;
+}
+
+/* all of these with emu.mutex held */
+
+static void emu_raise(unsigned int mask)
+{
+	struct emu_event *e;
+
+	for (e = emu.proc_events; e; e = e->next)
+		if (e->mask & mask)
+			e->pending = true;
+	pthread_cond_broadcast(&emu.cond);
+}
+
+static void emu_reply(struct emu_node *node,
+		uint32_t cmd,
+		uint32_t arg_1,
+		uint32_t arg_2)
+{
+	struct dsp_msg msg = { .cmd = cmd, .arg_1 = arg_1, .arg_2 = arg_2 };
+
+	if (!emu_ring_push(&node->out, &msg))
+		emu_raise(DSP_SYSERROR);
+	pthread_cond_broadcast(&emu.cond);
+}
+
+static struct emu_area *emu_find(uint32_t start)
+{
+	unsigned i;
+
+	for (i = 0; i < emu.nr_areas; i++)
+		if (emu.areas[i].start == start)
+			return &emu.areas[i];
+	return NULL;
+}
+
+static void *emu_translate(uint32_t addr,
+		unsigned long size)
+{
+	unsigned i;
+
+	for (i = 0; i < emu.nr_areas; i++) {
+		struct emu_area *a = &emu.areas[i];
+
+		if (!a->map || addr < a->map)
+			continue;
+		if (addr - a->map + (uint64_t) size <= a->map_size)
+			return (char *) a->mpu + (addr - a->map);
+	}
+	return NULL;
+}
+
+static uint32_t emu_reserve(unsigned long size)
+{
+	uint64_t start = emu.next_start;
+	bool wrapped = false;
+	unsigned i;
+
+	size = (size + 0xfff) & ~0xfffUL;
+again:
+	if (start + size > EMU_DSP_END) {
+		if (wrapped)
+			return 0;
+		wrapped = true;
+		start = EMU_DSP_START;
+	}
+	for (i = 0; i < emu.nr_areas; i++) {
+		struct emu_area *a = &emu.areas[i];
+
+		if (start < a->start + (uint64_t) a->size && a->start < start + size) {
+			start = a->start + (uint64_t) a->size;
+			goto again;
+		}
+	}
+
+	if (emu.nr_areas == emu.max_areas) {
+		unsigned max = emu.max_areas ? emu.max_areas * 2 : 64;
+		struct emu_area *areas = realloc(emu.areas, max * sizeof(*areas));
+
+		if (!areas)
+			return 0;
+		emu.areas = areas;
+		emu.max_areas = max;
+	}
+
+	emu.areas[emu.nr_areas++] = (struct emu_area) { .start = start, .size = size };
+	emu.next_start = start + size;
+
+	return start;
+}
+
+/* a pair of buffers; false on a fault */
+static bool emu_process(struct dsp_msg *in,
+		struct dsp_msg *out)
+{
+	struct emu_comm *in_comm, *out_comm;
+	unsigned char *src = NULL, *dst = NULL;
+	unsigned long len, i;
+
+	in_comm = emu_translate(in->arg_1, sizeof(*in_comm));
+	out_comm = emu_translate(out->arg_1, sizeof(*out_comm));
+	if (!in_comm || !out_comm)
+		return false;
+
+	len = in_comm->buffer_len;
+	if (len > out_comm->buffer_size)
+		len = out_comm->buffer_size;
+
+	if (emu.mode != EMU_PASS && len) {
+		src = emu_translate(in_comm->buffer_data, len);
+		dst = emu_translate(out_comm->buffer_data, len);
+		if (!src || !dst)
+			return false;
+	}
+
+	/* the work itself doesn't need the lock */
+	pthread_mutex_unlock(&emu.mutex);
+
+	if (emu.delay)
+		usleep(emu.delay);
+
+	if (emu.mode == EMU_ECHO)
+		memcpy(dst, src, len);
+	else if (emu.mode == EMU_INVERT)
+		for (i = 0; i < len; i++)
+			dst[i] = ~src[i];
+
+	pthread_mutex_lock(&emu.mutex);
+
+	out_comm->buffer_len = len;
+
+	return true;
+}
+
+static void emu_node_got(struct emu_node *node,
+		struct dsp_msg *msg)
+{
+	switch (msg->cmd & 0xffffff00) {
+	case 0x0600:
+		emu_ring_push((msg->cmd & 0xff) == 0 ? &node->inputs : &node->outputs, msg);
+		break;
+	case 0x0200:
+		/* the host takes back whatever was queued */
+		node->inputs.tail = node->inputs.head;
+		node->outputs.tail = node->outputs.head;
+		emu_reply(node, 0x0200, 0, 0);
+		break;
+	case 0x0400:
+		emu_reply(node, 0x0400, msg->arg_1, msg->arg_2);
+		break;
+	default:
+		break;
+	}
+}
+
+static void *emu_node_thread(void *data)
+{
+	struct emu_node *node = data;
+	struct dsp_msg msg, in, out;
+
+	pthread_mutex_lock(&emu.mutex);
+	while (!node->quit) {
+		if (emu_ring_pop(&node->in, &msg)) {
+			emu_node_got(node, &msg);
+			continue;
+		}
+
+		if (!emu_ring_empty(&node->inputs) && !emu_ring_empty(&node->outputs)) {
+			emu_ring_pop(&node->inputs, &in);
+			emu_ring_pop(&node->outputs, &out);
+			if (!emu_process(&in, &out)) {
+				emu_raise(DSP_MMUFAULT);
+				continue;
+			}
+			emu_reply(node, in.cmd, in.arg_1, 0);
+			emu_reply(node, out.cmd, out.arg_1, 0);
+			continue;
+		}
+
+		pthread_cond_wait(&node->cond, &emu.mutex);
+	}
+	pthread_mutex_unlock(&emu.mutex);
+
+	return NULL;
+}
+
+static void emu_node_stop(struct emu_node *node)
+{
+	if (!node->running)
+		return;
+
+	node->quit = true;
+	pthread_cond_signal(&node->cond);
+	pthread_mutex_unlock(&emu.mutex);
+	pthread_join(node->thread, NULL);
+	pthread_mutex_lock(&emu.mutex);
+	node->running = false;
+}
+
+static bool emu_event_ready(struct emu_event *e)
+{
+	if (!e)
+		return false;
+	if (e->node)
+		return !emu_ring_empty(&e->node->out);
+	if (e->pending) {
+		e->pending = false;
+		return true;
+	}
+	return false;
+}
+
+/* false on timeout; timeout in ms, -1 for none */
+static bool emu_wait(struct timespec *deadline,
+		unsigned int timeout)
+{
+	if (timeout == (unsigned int) -1) {
+		pthread_cond_wait(&emu.cond, &emu.mutex);
+		return true;
+	}
+
+	if (!deadline->tv_sec) {
+		clock_gettime(CLOCK_REALTIME, deadline);
+		deadline->tv_sec += timeout / 1000;
+		deadline->tv_nsec += (timeout % 1000) * 1000000;
+		if (deadline->tv_nsec >= 1000000000) {
+			deadline->tv_sec++;
+			deadline->tv_nsec -= 1000000000;
+		}
+	}
+
+	return pthread_cond_timedwait(&emu.cond, &emu.mutex, deadline) == 0;
+}
+
+static int emu_wait_for_events(struct wait_for_events *arg)
+{
+	struct timespec deadline = { 0 };
+	unsigned i;
+
+	while (true) {
+		for (i = 0; i < arg->count; i++) {
+			if (emu_event_ready(arg->notifications[i]->handle)) {
+				*arg->ret_index = i;
+				return 0;
+			}
+		}
+		if (!emu_wait(&deadline, arg->timeout))
+			break;
+	}
+
+	errno = ETIME;
+	return -1;
+}
+
+static int emu_get_message(struct node_get_message *arg)
+{
+	struct emu_node *node = arg->node_handle;
+	struct timespec deadline = { 0 };
+
+	while (!emu_ring_pop(&node->out, arg->message)) {
+		if (!arg->timeout || !emu_wait(&deadline, arg->timeout)) {
+			errno = ETIME;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int emu_locked_ioctl(unsigned long r,
+		void *arg)
+{
+	switch (r) {
+	case PROC_ATTACH: {
+		struct proc_attach *a = arg;
+		*a->ret_handle = &emu;
+		emu_raise(DSP_PROCESSORATTACH);
+		return 0;
+	}
+	case PROC_REGISTERNOTIFY: {
+		struct register_notify *a = arg;
+		struct emu_event *e = calloc(1, sizeof(*e));
+		e->mask = a->event_mask;
+		e->next = emu.proc_events;
+		emu.proc_events = e;
+		a->info->handle = e;
+		return 0;
+	}
+	case NODE_REGISTERNOTIFY: {
+		struct node_register_notify *a = arg;
+		struct emu_node *node = a->node_handle;
+		struct emu_event *e = node->event;
+		if (!e)
+			e = node->event = calloc(1, sizeof(*e));
+		e->mask = a->event_mask;
+		e->node = node;
+		a->info->handle = e;
+		return 0;
+	}
+	case MGR_WAIT:
+		return emu_wait_for_events(arg);
+	case NODE_GETUUIDPROPS: {
+		struct get_uuid_props *a = arg;
+		memset(a->props, 0, sizeof(*a->props));
+		a->props->node_id = *a->node_uuid;
+		a->props->ntype = DSP_NODE_TASK;
+		return 0;
+	}
+	case NODE_ALLOCATE: {
+		struct node_allocate *a = arg;
+		struct emu_node *node = calloc(1, sizeof(*node));
+		pthread_cond_init(&node->cond, NULL);
+		*a->ret_node = node;
+		return 0;
+	}
+	case NODE_GETATTR: {
+		struct node_get_attr *a = arg;
+		memset(a->attr, 0, a->attr_size);
+		a->attr->info.props.ntype = DSP_NODE_TASK;
+		return 0;
+	}
+	case CMM_GETHANDLE: {
+		struct cmm_get_handle *a = arg;
+		*a->cmm = (void *) &emu;
+		return 0;
+	}
+	case CMM_GETINFO: {
+		struct cmm_get_info *a = arg;
+		memset(a->info, 0, sizeof(*a->info));
+		return 0;
+	}
+	case NODE_RUN: {
+		struct node_run *a = arg;
+		struct emu_node *node = a->node_handle;
+		if (node->running)
+			return 0;
+		node->quit = false;
+		if (pthread_create(&node->thread, NULL, emu_node_thread, node)) {
+			errno = ENOMEM;
+			return -1;
+		}
+		node->running = true;
+		return 0;
+	}
+	case NODE_TERMINATE: {
+		struct node_terminate *a = arg;
+		emu_node_stop(a->node_handle);
+		*a->status = 0;
+		return 0;
+	}
+	case NODE_DELETE: {
+		struct node_delete *a = arg;
+		struct emu_node *node = a->node_handle;
+		emu_node_stop(node);
+		pthread_cond_destroy(&node->cond);
+		free(node->event);
+		free(node);
+		return 0;
+	}
+	case NODE_PUTMESSAGE: {
+		struct node_put_message *a = arg;
+		struct emu_node *node = a->node_handle;
+		if (!emu_ring_push(&node->in, a->message)) {
+			errno = EBUSY;
+			return -1;
+		}
+		pthread_cond_signal(&node->cond);
+		return 0;
+	}
+	case NODE_GETMESSAGE:
+		return emu_get_message(arg);
+	case PROC_RSVMEM: {
+		struct reserve_mem *a = arg;
+		uint32_t start = emu_reserve(a->size);
+		if (!start) {
+			errno = ENOMEM;
+			return -1;
+		}
+		*a->addr = (void *) (uintptr_t) start;
+		return 0;
+	}
+	case PROC_UNRSVMEM: {
+		struct unreserve_mem *a = arg;
+		struct emu_area *area = emu_find((uintptr_t) a->addr);
+		if (!area) {
+			errno = EINVAL;
+			return -1;
+		}
+		*area = emu.areas[--emu.nr_areas];
+		return 0;
+	}
+	case PROC_MAPMEM: {
+		struct map_mem *a = arg;
+		struct emu_area *area = emu_find((uintptr_t) a->req_addr);
+		uint32_t offset = (uintptr_t) a->mpu_addr & 0xfff;
+		if (!area || offset + a->size > area->size) {
+			errno = EINVAL;
+			return -1;
+		}
+		area->map = area->start + offset;
+		area->map_size = a->size;
+		area->mpu = a->mpu_addr;
+		*a->ret_map_addr = (void *) (uintptr_t) area->map;
+		return 0;
+	}
+	case PROC_UNMAPMEM: {
+		struct unmap_mem *a = arg;
+		unsigned i;
+		for (i = 0; i < emu.nr_areas; i++) {
+			if (emu.areas[i].map == (uintptr_t) a->map_addr) {
+				emu.areas[i].map = 0;
+				return 0;
+			}
+		}
+		errno = EINVAL;
+		return -1;
+	}
+	case PROC_ENUMRESOURCES: {
+		struct proc_get_info *a = arg;
+		memset(a->info, 0, a->size);
+		return 0;
+	}
+	case PROC_DETACH:
+	case PROC_START:
+	case PROC_STOP:
+	case PROC_LOAD:
+	case MGR_REGISTEROBJECT:
+	case MGR_UNREGISTEROBJECT:
+	case NODE_CREATE:
+	case PROC_FLUSHMEMORY:
+	case PROC_INVALIDATEMEMORY:
+#if DSP_API >= 1
+	case PROC_BEGINDMA:
+	case PROC_ENDDMA:
+#endif
+		return 0;
+	default:
+		errno = ENOSYS;
+		return -1;
+	}
+}
+
+static int emu_ioctl(int fd,
+		unsigned long r,
+		void *arg)
+{
+	int ret;
+
+	pthread_mutex_lock(&emu.mutex);
+	ret = emu_locked_ioctl(r, arg);
+	pthread_mutex_unlock(&emu.mutex);
+
+	return ret;
+}
+
+#endif /* DSP_EMU */
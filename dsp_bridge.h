@@ -17,6 +17,7 @@
 
 #define ALLOCATE_HEAP
 
+#define DSP_PROCESSORATTACH 0x00000002
 #define DSP_MMUFAULT 0x00000010
 #define DSP_SYSERROR 0x00000020
 #define DSP_NODEMESSAGEREADY 0x00000200
@@ -41,6 +42,7 @@ struct dsp_node {
 	void *heap;
 	void *msgbuf_addr;
 	size_t msgbuf_size;
+	unsigned long msgbuf_dsp_addr;
 };
 
 /* note: cmd = 0x20000000 has special handling */
@@ -237,6 +239,31 @@ struct dsp_node_attr {
 	struct dsp_node_info info;
 };
 
+/*
+ * Per-command ioctl counters, for all handles of the process. Off unless
+ * dsp_ioctl_stats_enable() or GST_DSP_IOCTL_STATS in the environment.
+ * The histogram buckets are times under 10us, 30us, 100us, 300us, 1ms,
+ * 3ms, 10ms, and longer.
+ */
+#define DSP_IOCTL_BUCKETS 8
+#define DSP_IOCTL_MAX 256
+
+struct dsp_ioctl_stats {
+	const char *name;
+	unsigned long calls;
+	unsigned long errors;
+	uint64_t time; /* ns */
+	uint64_t max_time; /* ns */
+	unsigned long histogram[DSP_IOCTL_BUCKETS];
+};
+
+extern bool dsp_ioctl_stats_enabled;
+
+void dsp_ioctl_stats_enable(bool enable);
+void dsp_ioctl_stats_reset(void);
+/* indexed by command number; unused ones have no calls */
+const struct dsp_ioctl_stats *dsp_ioctl_stats_get(void);
+
 int dsp_open(void);
 
 int dsp_close(int handle);
@@ -270,6 +297,21 @@ bool dsp_node_allocate(int handle,
 bool dsp_node_free(int handle,
 		struct dsp_node *node);
 
+/*
+ * Allocate from the node's message buffer segment in the CMM shared memory,
+ * through the bridge so it doesn't hand the same memory out again; the DSP
+ * sees it at dsp_addr, no reserve/map needed. Free it before the node.
+ */
+bool dsp_node_shm_alloc(int handle,
+		struct dsp_node *node,
+		size_t size,
+		void **addr,
+		unsigned long *dsp_addr);
+
+bool dsp_node_shm_free(int handle,
+		struct dsp_node *node,
+		void *addr);
+
 bool dsp_node_connect(int handle,
 		struct dsp_node *node,
 		unsigned int stream,
@@ -397,6 +439,40 @@ dsp_send_message(int handle,
 	return dsp_node_put_message(handle, node, &msg, -1);
 }
 
+/*
+ * Messages to one node, put back to back by dsp_msg_batch_flush(); the
+ * owner flushes when dsp_msg_batch_add() says it's full.
+ */
+#define DSP_MSG_BATCH_MAX 16
+
+struct dsp_msg_batch {
+	int handle;
+	struct dsp_node *node;
+	unsigned count;
+	struct dsp_msg msgs[DSP_MSG_BATCH_MAX];
+};
+
+static inline bool
+dsp_msg_batch_add(struct dsp_msg_batch *batch,
+		uint32_t cmd,
+		uint32_t arg_1,
+		uint32_t arg_2)
+{
+	struct dsp_msg *msg;
+
+	if (batch->count == DSP_MSG_BATCH_MAX)
+		return false;
+
+	msg = &batch->msgs[batch->count++];
+	msg->cmd = cmd;
+	msg->arg_1 = arg_1;
+	msg->arg_2 = arg_2;
+
+	return true;
+}
+
+bool dsp_msg_batch_flush(struct dsp_msg_batch *batch);
+
 bool dsp_node_get_attr(int handle,
 		struct dsp_node *node,
 		struct dsp_node_attr *attr,
@@ -13,14 +13,57 @@
 #include "plugin.h"
 
 #include "dsp_bridge.h"
+#include "dmm_cache.h"
+#include "trace.h"
 
 #include <string.h> /* for memcpy */
+#include <errno.h>
+#include <stdio.h> /* for snprintf */
+#include <malloc.h> /* for malloc_usable_size */
 
 #include "util.h"
 #include "log.h"
 
 #define GST_CAT_DEFAULT gstdsp_debug
 
+enum {
+	ARG_0,
+	ARG_MAP_CACHE_SIZE,
+	ARG_MAP_UNDERSIZED,
+	ARG_OUTPUT_CPU_ACCESS,
+	ARG_SHARED_MEMORY,
+	ARG_STATS_INTERVAL,
+	ARG_PREWARM_CAPS,
+	ARG_MIN_BUFFERS,
+	ARG_MAX_BUFFERS,
+	ARG_LOW_LATENCY,
+	ARG_TRACE_SIZE,
+	ARG_TRACE_FILE,
+	ARG_IOCTL_STATS,
+	ARG_LIVE_MAPPINGS,
+	ARG_MAPPED_BYTES,
+	ARG_PEAK_MAPPED_BYTES,
+	ARG_RESERVED_BYTES,
+	ARG_PEAK_RESERVED_BYTES,
+	ARG_RESERVE_CALLS,
+	ARG_MAP_CALLS,
+	ARG_COPIES,
+};
+
+#define DEFAULT_MAP_CACHE_SIZE 0
+#define DEFAULT_MAP_UNDERSIZED FALSE
+#define DEFAULT_OUTPUT_CPU_ACCESS TRUE
+#define DEFAULT_SHARED_MEMORY FALSE
+#define DEFAULT_STATS_INTERVAL 0
+#define DEFAULT_MIN_BUFFERS 1
+#define DEFAULT_MAX_BUFFERS 0
+#define DEFAULT_LOW_LATENCY FALSE
+#define DEFAULT_TRACE_SIZE 0
+#define DEFAULT_IOCTL_STATS FALSE
+
+#define DRAIN_TIMEOUT 2 /* s */
+#define ADAPT_WINDOW 32 /* buffers */
+
 static inline bool send_buffer(GstDspBase *self, struct td_buffer *tb);
 
 static inline void
@@ -28,6 +71,10 @@ map_buffer(GstDspBase *self,
 	   GstBuffer *g_buf,
 	   struct td_buffer *tb);
 
+static void prewarm_start(GstDspBase *self);
+static void prewarm_finish(GstDspBase *self, GstCaps *caps);
+static void report_error(GstDspBase *self);
+
 static inline long
 get_elapsed_eos(GstDspBase *self)
 {
@@ -55,7 +102,7 @@ du_port_new(int id,
 		return NULL;
 
 	p->id = id;
-	p->queue = async_queue_new();
+	p->queue = async_queue_new(DU_PORT_MAX_BUFFERS);
 	p->dir = dir;
 
 	return p;
@@ -76,11 +123,14 @@ du_port_free(du_port_t *p)
 void
 du_port_alloc_buffers(du_port_t *p, guint num_buffers)
 {
+	g_assert(num_buffers <= DU_PORT_MAX_BUFFERS);
 	p->num_buffers = num_buffers;
 	free(p->buffers);
 	p->buffers = calloc(num_buffers, sizeof(*p->buffers));
 	for (unsigned i = 0; i < p->num_buffers; i++)
 		p->buffers[i].port = p;
+	p->active = num_buffers;
+	p->num_parked = 0;
 }
 
 static inline void
@@ -97,8 +147,45 @@ du_port_flush(du_port_t *p)
 			gst_buffer_unref(tb->user_data);
 		dmm_buffer_free(b);
 		tb->data = NULL;
+		tb->pinned = false;
 	}
 	async_queue_flush(p->queue);
+
+	gstdsp_pool_destroy(p->pool);
+	p->pool = NULL;
+
+	p->num_parked = 0;
+	p->in_dsp = 0;
+	p->replies = p->starved = 0;
+	p->turnaround = 0;
+}
+
+/*
+ * With max-buffers, the node is created with that many buffers on each
+ * port, but only 'active' of them go around; the rest are parked when they
+ * come back to us, and unparked when the port needs more. Each port is
+ * touched by one thread: the DSP thread for the input, output_loop for the
+ * output.
+ */
+
+static inline bool
+port_park(du_port_t *p,
+	  struct td_buffer *tb)
+{
+	if (p->num_buffers - p->num_parked <= g_atomic_int_get(&p->active))
+		return false;
+	p->parked[p->num_parked++] = tb;
+	return true;
+}
+
+static inline struct td_buffer *
+port_unpark(du_port_t *p)
+{
+	if (!p->num_parked)
+		return NULL;
+	if (p->num_buffers - p->num_parked >= g_atomic_int_get(&p->active))
+		return NULL;
+	return p->parked[--p->num_parked];
 }
 
 static inline void
@@ -135,6 +222,149 @@ g_sem_reset(GSem *sem,
 	g_mutex_unlock(sem->mutex);
 }
 
+/*
+ * Timestamp ring: pad_chain (and sink_event) produce, output_loop consumes,
+ * so each index has a single writer. Serialized events ride along with the
+ * next buffer, so there can be any number of them. The ring grows if the
+ * codec holds more frames than expected; the old one is kept until stop,
+ * since output_loop might still be reading it.
+ */
+
+#define TS_HEADROOM 8 /* frames the codec might keep to itself */
+
+/* full barriers; still much cheaper than the mutex this used to take */
+static inline guint
+ts_get(guint *pos)
+{
+	guint value;
+	__sync_synchronize();
+	value = *(volatile guint *) pos;
+	__sync_synchronize();
+	return value;
+}
+
+static inline void
+ts_set(guint *pos,
+       guint value)
+{
+	__sync_synchronize();
+	*(volatile guint *) pos = value;
+	__sync_synchronize();
+}
+
+static inline struct ts_ring *
+ts_ring_new(guint size)
+{
+	struct ts_ring *ring;
+	guint n = 2;
+
+	while (n < size)
+		n <<= 1;
+
+	ring = g_malloc0(sizeof(*ring) + n * sizeof(ring->items[0]));
+	ring->mask = n - 1;
+
+	return ring;
+}
+
+static void
+ts_ring_grow(GstDspBase *self)
+{
+	struct ts_ring *old = self->ts_ring, *ring;
+	guint i;
+
+	ring = ts_ring_new((old->mask + 1) * 2);
+	for (i = ts_get(&self->ts_out_pos); i != self->ts_in_pos; i++)
+		ring->items[i & ring->mask] = old->items[i & old->mask];
+
+	pr_info(self, "timestamp ring grown to %u", ring->mask + 1);
+
+	self->ts_retired = g_slist_prepend(self->ts_retired, old);
+	__sync_synchronize();
+	*(struct ts_ring * volatile *) &self->ts_ring = ring;
+}
+
+static inline void
+ts_push(GstDspBase *self,
+	GstClockTime time,
+	GstClockTime duration)
+{
+	struct ts_item *item;
+	guint in = self->ts_in_pos;
+
+	if (G_UNLIKELY(in - ts_get(&self->ts_out_pos) > self->ts_ring->mask))
+		ts_ring_grow(self);
+
+	item = &self->ts_ring->items[in & self->ts_ring->mask];
+	item->time = time;
+	item->duration = duration;
+	item->events = g_slist_reverse(self->ts_events);
+	self->ts_events = NULL;
+	if (self->low_latency)
+		item->arrival = gst_util_get_timestamp();
+
+	ts_set(&self->ts_in_pos, in + 1);
+}
+
+/* the oldest item; output_loop only */
+static inline struct ts_item *
+ts_peek(GstDspBase *self)
+{
+	struct ts_ring *ring;
+
+	if (ts_get(&self->ts_in_pos) == self->ts_out_pos)
+		return NULL;
+
+	ring = *(struct ts_ring * volatile *) &self->ts_ring;
+	return &ring->items[self->ts_out_pos & ring->mask];
+}
+
+/* returns whether the ring is empty now */
+static inline bool
+ts_pop(GstDspBase *self)
+{
+	guint out = self->ts_out_pos + 1;
+
+	self->ts_events_sent = FALSE;
+	ts_set(&self->ts_out_pos, out);
+
+	return out == ts_get(&self->ts_in_pos);
+}
+
+static inline void
+ts_free_events(GSList *events)
+{
+	GSList *l;
+	for (l = events; l; l = l->next)
+		gst_event_unref(l->data);
+	g_slist_free(events);
+}
+
+/* neither side may be running */
+static void
+ts_reset(GstDspBase *self)
+{
+	guint i;
+
+	for (i = self->ts_out_pos; i != self->ts_in_pos; i++) {
+		if (i == self->ts_out_pos && self->ts_events_sent)
+			continue;
+		ts_free_events(self->ts_ring->items[i & self->ts_ring->mask].events);
+	}
+
+	ts_free_events(self->ts_events);
+	self->ts_events = NULL;
+
+	while (self->ts_retired) {
+		g_free(self->ts_retired->data);
+		self->ts_retired = g_slist_delete_link(self->ts_retired, self->ts_retired);
+	}
+
+	self->ts_in_pos = self->ts_out_pos = self->ts_push_pos = 0;
+	self->ts_events_sent = FALSE;
+	self->ts_empty = 0;
+}
+
 typedef struct {
 	uint32_t buffer_data;
 	uint32_t buffer_size;
@@ -160,8 +390,218 @@ typedef struct {
 	uint32_t stream_id;
 } dsp_comm_t;
 
+/*
+ * Messages for the node sent while a batch is open in this thread go
+ * together when it's closed. Their comm buffers are from the slab, so
+ * usually in the same page; with the old cache API that's one flush for
+ * all of them. The bridge has no ioctl for several messages, so with the
+ * newer API, which cleans every range on its own, there's nothing to
+ * gain, and batches don't open.
+ */
+
+struct batch {
+	GstDspBase *self;
+	struct dsp_msg_batch msgs;
+	dmm_buffer_t *comm[DSP_MSG_BATCH_MAX];
+	unsigned nr_comm;
+};
+
+static __thread struct batch *current_batch;
+
+static inline void
+batch_clean(struct batch *batch)
+{
+	unsigned i;
+
+	if (!batch->nr_comm)
+		return;
+
+#if DSP_API < 2
+	{
+		char *start, *end;
+		bool one_page = true;
+
+		start = batch->comm[0]->data;
+		end = start + sizeof(dsp_comm_t);
+		for (i = 1; i < batch->nr_comm; i++) {
+			char *data = batch->comm[i]->data;
+			if (data < start)
+				start = data;
+			if (data + sizeof(dsp_comm_t) > end)
+				end = data + sizeof(dsp_comm_t);
+		}
+		for (i = 0; i < batch->nr_comm; i++)
+			if (!batch->comm[i]->slab)
+				one_page = false;
+		if ((uintptr_t) start / PAGE_SIZE != (uintptr_t) (end - 1) / PAGE_SIZE)
+			one_page = false;
+
+		if (one_page) {
+			dsp_flush(batch->msgs.handle, batch->self->proc, start, end - start, 1);
+			batch->nr_comm = 0;
+			return;
+		}
+	}
+#endif
+
+	for (i = 0; i < batch->nr_comm; i++)
+		dmm_buffer_begin(batch->comm[i], sizeof(dsp_comm_t));
+	batch->nr_comm = 0;
+}
+
+static inline void
+batch_flush(struct batch *batch)
+{
+	batch_clean(batch);
+	if (!dsp_msg_batch_flush(&batch->msgs))
+		pr_err(batch->self, "failed to send messages");
+}
+
+static inline void
+batch_begin(GstDspBase *self,
+	    struct batch *batch)
+{
+	batch->self = self;
+	batch->msgs.handle = self->dsp_handle;
+	batch->msgs.node = self->node;
+	batch->msgs.count = 0;
+	batch->nr_comm = 0;
+#if DSP_API < 2
+	current_batch = batch;
+#endif
+}
+
+static inline void
+batch_end(struct batch *batch)
+{
+	current_batch = NULL;
+	batch_flush(batch);
+}
+
+static inline struct batch *
+get_batch(GstDspBase *self,
+	  struct dsp_node *node)
+{
+	struct batch *batch = current_batch;
+
+	if (!batch || batch->self != self || batch->msgs.node != node)
+		return NULL;
+	return batch;
+}
+
+static inline void
+trace_ioctl(GstDspBase *self,
+	    uint64_t start,
+	    uint32_t cmd,
+	    bool ok)
+{
+	uint64_t end = trace_now();
+
+	trace_add_at(self->trace, end, TRACE_IOCTL, cmd, end - start);
+	if (G_UNLIKELY(!ok))
+		trace_add_at(self->trace, end, TRACE_ERROR, cmd, errno);
+}
+
+static inline bool
+send_message(GstDspBase *self,
+	     struct dsp_node *node,
+	     uint32_t cmd,
+	     uint32_t arg_1,
+	     uint32_t arg_2)
+{
+	struct batch *batch = get_batch(self, node);
+
+	if (!batch) {
+		uint64_t start;
+		bool ok;
+
+		if (!self->trace)
+			return dsp_send_message(self->dsp_handle, node, cmd, arg_1, arg_2);
+
+		start = trace_now();
+		ok = dsp_send_message(self->dsp_handle, node, cmd, arg_1, arg_2);
+		trace_ioctl(self, start, cmd, ok);
+		return ok;
+	}
+
+	if (!dsp_msg_batch_add(&batch->msgs, cmd, arg_1, arg_2)) {
+		batch_flush(batch);
+		dsp_msg_batch_add(&batch->msgs, cmd, arg_1, arg_2);
+	}
+	return true;
+}
+
+/* a comm buffer to clean before the batch goes */
+static inline void
+send_comm(GstDspBase *self,
+	  dmm_buffer_t *comm)
+{
+	struct batch *batch = get_batch(self, self->node);
+
+	if (!batch || comm->uncached) {
+		dmm_buffer_begin(comm, sizeof(dsp_comm_t));
+		return;
+	}
+
+	/* the message will need room too */
+	if (batch->msgs.count == DSP_MSG_BATCH_MAX)
+		batch_flush(batch);
+	batch->comm[batch->nr_comm++] = comm;
+}
+
 static GstElementClass *parent_class;
 
+/*
+ * Every ADAPT_WINDOW buffers back from a port, see how the DSP did: if it
+ * ran out of the port's buffers often, give it one more; if it never did,
+ * and there were always two to spare, take one away.
+ */
+static inline void
+port_adapt(GstDspBase *self,
+	   du_port_t *p,
+	   struct td_buffer *tb)
+{
+	gint held;
+	guint spare, active, max, min;
+
+	/* max-buffers might have been set with buffers out */
+	held = g_atomic_int_exchange_and_add(&p->in_dsp, -1) - 1;
+	if (held < 0)
+		held = 0;
+	p->turnaround = (p->turnaround * 7 + gst_util_get_timestamp() - tb->sent) / 8;
+
+	/* the input ones waiting for pad_chain are spare too */
+	spare = held;
+	if (p->id == 0)
+		spare += async_queue_length(p->queue);
+
+	if (held == 0)
+		p->starved++;
+	if (p->replies == 0 || spare < p->min_spare)
+		p->min_spare = spare;
+
+	if (++p->replies < ADAPT_WINDOW)
+		return;
+
+	max = p->num_buffers;
+	min = MIN(self->min_buffers, max);
+	active = p->active;
+
+	if (p->starved * 4 > p->replies && active < max)
+		active++;
+	else if (!p->starved && p->min_spare >= 2 && active > min)
+		active--;
+
+	if (active != p->active) {
+		pr_info(self, "%s buffers: %u -> %u (turnaround %" GST_TIME_FORMAT ")",
+			p->id == 0 ? "input" : "output", p->active, active,
+			GST_TIME_ARGS(p->turnaround));
+		g_atomic_int_set(&p->active, active);
+	}
+
+	p->replies = p->starved = 0;
+}
+
 static inline void
 got_message(GstDspBase *self,
 	    struct dsp_msg *msg)
@@ -211,8 +651,12 @@ got_message(GstDspBase *self,
 		if (G_UNLIKELY(b->len > b->size))
 			g_error("wrong buffer size");
 
+		trace_add(self->trace, TRACE_REPLY, id, b->len);
+
 		if (tb->pinned)
 			dmm_buffer_end(b, b->len);
+		else if (b->cached)
+			dmm_cache_release(self->map_cache, b);
 		else
 			dmm_buffer_unmap(b);
 
@@ -230,6 +674,17 @@ got_message(GstDspBase *self,
 			}
 		}
 
+		if (G_UNLIKELY(self->max_buffers)) {
+			port_adapt(self, p, tb);
+			if (id == 0) {
+				struct td_buffer *extra = port_unpark(p);
+				if (extra)
+					async_queue_push(p->queue, extra);
+				else if (port_park(p, tb))
+					break;
+			}
+		}
+
 		async_queue_push(p->queue, tb);
 		break;
 	}
@@ -238,6 +693,8 @@ got_message(GstDspBase *self,
 		break;
 	case 0x0200:
 		pr_debug(self, "got stop");
+		/* nothing else is coming; don't wait for another event */
+		self->done = TRUE;
 		g_sem_up(self->flush);
 		break;
 	case 0x0400:
@@ -268,52 +725,96 @@ got_message(GstDspBase *self,
 	}
 }
 
-static inline void
-setup_buffers(GstDspBase *self)
+static void
+setup_output_buffer(GstDspBase *self,
+		    struct td_buffer *tb,
+		    bool first)
 {
 	GstBuffer *buf = NULL;
+	du_port_t *p = tb->port;
 	dmm_buffer_t *b;
+
+	if (p->pool) {
+		tb->data = gstdsp_pool_get(p->pool);
+		tb->pinned = true;
+		self->send_buffer(self, tb);
+		return;
+	}
+
+	tb->data = b = dmm_buffer_new(self->dsp_handle, self->proc, p->dir);
+
+	if (self->use_pad_alloc) {
+		GstFlowReturn ret;
+		bool use_pool = false;
+		ret = gst_pad_alloc_buffer_and_set_caps(self->srcpad,
+							GST_BUFFER_OFFSET_NONE,
+							self->output_buffer_size,
+							GST_PAD_CAPS(self->srcpad),
+							&buf);
+		/* might fail if not (yet) linked */
+		if (G_UNLIKELY(ret != GST_FLOW_OK)) {
+			pr_err(self, "couldn't allocate buffer: %s", gst_flow_get_name(ret));
+			dmm_buffer_allocate(b, self->output_buffer_size);
+			b->need_copy = true;
+		} else {
+			/* plain memory; downstream gains nothing from it */
+			use_pool = GST_BUFFER_MALLOCDATA(buf) != NULL;
+			map_buffer(self, buf, tb);
+			gst_buffer_unref(buf);
+			if (b->need_copy)
+				use_pool = true;
+		}
+
+		if (first && use_pool && self->use_pool) {
+			pr_info(self, "using own output buffer pool");
+			if (tb->user_data) {
+				gst_buffer_unref(tb->user_data);
+				tb->user_data = NULL;
+			}
+			dmm_buffer_free(b);
+			p->pool = gstdsp_pool_new(self, p->dir,
+						  self->output_buffer_size,
+						  p->num_buffers);
+			tb->data = gstdsp_pool_get(p->pool);
+			tb->pinned = true;
+		}
+	}
+	else {
+		dmm_buffer_allocate(b, self->output_buffer_size);
+		if (self->use_pinned) {
+			dmm_buffer_map(b);
+			tb->pinned = tb->clean = true;
+		}
+	}
+
+	self->send_buffer(self, tb);
+}
+
+static inline void
+setup_buffers(GstDspBase *self)
+{
 	du_port_t *p;
 	guint i;
 
 	p = self->ports[0];
 	for (i = 0; i < p->num_buffers; i++) {
-		p->buffers[i].data = b = dmm_buffer_new(self->dsp_handle, self->proc, p->dir);
-		async_queue_push(p->queue, &p->buffers[i]);
+		p->buffers[i].data = dmm_buffer_new(self->dsp_handle, self->proc, p->dir);
+		if (!port_park(p, &p->buffers[i]))
+			async_queue_push(p->queue, &p->buffers[i]);
 	}
 
 	p = self->ports[1];
-	for (i = 0; i < p->num_buffers; i++) {
-		struct td_buffer *tb = &p->buffers[i];
-		tb->data = b = dmm_buffer_new(self->dsp_handle, self->proc, p->dir);
-
-		if (self->use_pad_alloc) {
-			GstFlowReturn ret;
-			ret = gst_pad_alloc_buffer_and_set_caps(self->srcpad,
-								GST_BUFFER_OFFSET_NONE,
-								self->output_buffer_size,
-								GST_PAD_CAPS(self->srcpad),
-								&buf);
-			/* might fail if not (yet) linked */
-			if (G_UNLIKELY(ret != GST_FLOW_OK)) {
-				pr_err(self, "couldn't allocate buffer: %s", gst_flow_get_name(ret));
-				dmm_buffer_allocate(b, self->output_buffer_size);
-				b->need_copy = true;
-			} else {
-				map_buffer(self, buf, tb);
-				gst_buffer_unref(buf);
-			}
-		}
-		else {
-			dmm_buffer_allocate(b, self->output_buffer_size);
-			if (self->use_pinned) {
-				dmm_buffer_map(b);
-				tb->pinned = tb->clean = true;
-			}
-		}
+	if (self->use_pool && !self->use_pad_alloc && !self->use_pinned)
+		p->pool = gstdsp_pool_new(self, p->dir, self->output_buffer_size,
+					  p->num_buffers);
 
-		self->send_buffer(self, tb);
-	}
+	/* park before anything comes back to output_loop */
+	for (i = p->num_buffers; i > 0; i--)
+		if (!port_park(p, &p->buffers[i - 1]))
+			break;
+
+	for (i = 0; i < p->num_buffers - p->num_parked; i++)
+		setup_output_buffer(self, &p->buffers[i], i == 0);
 }
 
 static inline void
@@ -321,15 +822,19 @@ pause_task(GstDspBase *self, GstFlowReturn status)
 {
 	bool deferred_eos;
 
-	/* synchronize to ensure we are not dropping the EOS event */
-	g_mutex_lock(self->ts_mutex);
+	/* sink_event checks the status after deferring the EOS */
 	(void) g_atomic_int_compare_and_exchange(&self->status, GST_FLOW_OK, status);
 	deferred_eos = g_atomic_int_compare_and_exchange(&self->deferred_eos, true, false);
-	g_mutex_unlock(self->ts_mutex);
 
 	pr_info(self, "pausing task; reason %s", gst_flow_get_name(status));
 	gst_pad_pause_task(self->srcpad);
 
+	report_error(self);
+
+	/* nothing else will come out */
+	if (g_atomic_int_compare_and_exchange(&self->draining, true, false))
+		g_sem_up(self->drained);
+
 	/* avoid waiting for buffers that will never come */
 	async_queue_disable(self->ports[0]->queue);
 	async_queue_disable(self->ports[1]->queue);
@@ -353,6 +858,168 @@ check_status(GstDspBase *self)
 	return ret;
 }
 
+static inline const char *
+ioctl_field(char *buf,
+	    size_t size,
+	    const struct dsp_ioctl_stats *c,
+	    const char *suffix)
+{
+	snprintf(buf, size, "%s-%s", c->name ? c->name : "unknown", suffix);
+	return buf;
+}
+
+/* the commands used so far, as <command>-<counter> fields */
+static GstStructure *
+ioctl_stats_structure(void)
+{
+	const struct dsp_ioctl_stats *stats = dsp_ioctl_stats_get();
+	GstStructure *s;
+	unsigned i, j;
+	char f[64];
+
+	s = gst_structure_empty_new("dsp-ioctl");
+
+	for (i = 0; i < DSP_IOCTL_MAX; i++) {
+		const struct dsp_ioctl_stats *c = &stats[i];
+		GValue histogram = { 0 }, v = { 0 };
+
+		if (!c->calls)
+			continue;
+
+		g_value_init(&histogram, GST_TYPE_ARRAY);
+		g_value_init(&v, G_TYPE_ULONG);
+		for (j = 0; j < DSP_IOCTL_BUCKETS; j++) {
+			g_value_set_ulong(&v, c->histogram[j]);
+			gst_value_array_append_value(&histogram, &v);
+		}
+		g_value_unset(&v);
+
+		gst_structure_set(s,
+				  ioctl_field(f, sizeof(f), c, "calls"), G_TYPE_ULONG, c->calls,
+				  NULL);
+		gst_structure_set(s,
+				  ioctl_field(f, sizeof(f), c, "errors"), G_TYPE_ULONG, c->errors,
+				  NULL);
+		gst_structure_set(s,
+				  ioctl_field(f, sizeof(f), c, "time"), G_TYPE_UINT64, c->time,
+				  NULL);
+		gst_structure_set(s,
+				  ioctl_field(f, sizeof(f), c, "max-time"), G_TYPE_UINT64, c->max_time,
+				  NULL);
+		gst_structure_set_value(s, ioctl_field(f, sizeof(f), c, "histogram"), &histogram);
+		g_value_unset(&histogram);
+	}
+
+	return s;
+}
+
+static void
+post_stats(GstDspBase *self)
+{
+	struct dmm_stats *stats = self->stats;
+	GstClockTime now;
+	GstStructure *s;
+
+	if (!self->stats_interval || !stats)
+		return;
+
+	now = gst_util_get_timestamp();
+	if (now - self->stats_last < self->stats_interval * GST_MSECOND)
+		return;
+	self->stats_last = now;
+
+	s = gst_structure_new("dsp-memory",
+			      "live-mappings", G_TYPE_ULONG, stats->maps,
+			      "mapped-bytes", G_TYPE_ULONG, stats->mapped,
+			      "peak-mapped-bytes", G_TYPE_ULONG, stats->peak_mapped,
+			      "reserved-bytes", G_TYPE_ULONG, stats->reserved,
+			      "peak-reserved-bytes", G_TYPE_ULONG, stats->peak_reserved,
+			      "reserve-calls", G_TYPE_ULONG, stats->reserve_calls,
+			      "map-calls", G_TYPE_ULONG, stats->map_calls,
+			      "copies", G_TYPE_ULONG, stats->copies,
+			      NULL);
+	gst_element_post_message(GST_ELEMENT(self),
+				 gst_message_new_element(GST_OBJECT(self), s));
+
+	if (dsp_ioctl_stats_enabled)
+		gst_element_post_message(GST_ELEMENT(self),
+					 gst_message_new_element(GST_OBJECT(self),
+								 ioctl_stats_structure()));
+}
+
+/*
+ * From the buffer's arrival to its output; a peak that slowly decays, so
+ * one hiccup doesn't count forever. The pipeline is told when it grows.
+ */
+static inline void
+measure_latency(GstDspBase *self,
+		struct ts_item *item)
+{
+	GstClockTime latency, decayed;
+
+	if (!item->arrival)
+		return;
+
+	latency = gst_util_get_timestamp() - item->arrival;
+	decayed = self->latency - self->latency / 16;
+	self->latency = MAX(latency, decayed);
+
+	if (self->latency > self->latency_reported + self->latency_reported / 4) {
+		pr_info(self, "latency: %" GST_TIME_FORMAT, GST_TIME_ARGS(self->latency));
+		self->latency_reported = self->latency;
+		gst_element_post_message(GST_ELEMENT(self),
+					 gst_message_new_latency(GST_OBJECT(self)));
+	}
+}
+
+static inline void
+send_events(GstDspBase *self,
+	    struct ts_item *item,
+	    gboolean flushed)
+{
+	GstEvent *event;
+	GSList *l;
+
+	if (self->ts_events_sent)
+		return;
+
+	for (l = item->events; l; l = l->next) {
+		event = l->data;
+		if (G_LIKELY(!flushed)) {
+			pr_debug(self, "pushing event: %s", GST_EVENT_TYPE_NAME(event));
+			gst_pad_push_event(self->srcpad, event);
+		} else {
+			pr_debug(self, "ignored flushed event: %s", GST_EVENT_TYPE_NAME(event));
+			gst_event_unref(event);
+		}
+	}
+	g_slist_free(item->events);
+	self->ts_events_sent = TRUE;
+}
+
+/*
+ * With draining; once only the timestamps of frames that gave no output
+ * are left, nothing else will come for them.
+ */
+static inline void
+check_drained(GstDspBase *self)
+{
+	struct ts_item *item;
+
+	if (ts_get(&self->ts_in_pos) - self->ts_out_pos > (guint) g_atomic_int_get(&self->ts_empty))
+		return;
+
+	while ((item = ts_peek(self))) {
+		send_events(self, item, self->ts_out_pos != self->ts_push_pos);
+		ts_pop(self);
+	}
+	self->ts_push_pos = self->ts_out_pos;
+	g_atomic_int_set(&self->ts_empty, 0);
+
+	if (g_atomic_int_compare_and_exchange(&self->draining, true, false))
+		g_sem_up(self->drained);
+}
+
 static void
 output_loop(gpointer data)
 {
@@ -364,11 +1031,11 @@ output_loop(gpointer data)
 	gboolean flush_buffer;
 	gboolean got_eos = FALSE;
 	gboolean keyframe = FALSE;
-	GstEvent *event;
 	du_port_t *p;
 	struct td_buffer *tb;
 	bool handled;
 	GstClockTime timestamp, duration;
+	struct ts_item *item;
 
 	pad = data;
 	self = GST_DSP_BASE(GST_OBJECT_PARENT(pad));
@@ -402,30 +1069,21 @@ output_loop(gpointer data)
 	}
 
 	/* check for too many buffers returned */
-	g_mutex_lock(self->ts_mutex);
-	if (G_UNLIKELY(b->len && !self->ts_count)) {
+	item = ts_peek(self);
+	if (G_UNLIKELY(b->len && !item)) {
 		pr_warning(self, "no timestamp; unexpected buffer");
-		g_mutex_unlock(self->ts_mutex);
 		goto leave;
 	}
-	g_mutex_unlock(self->ts_mutex);
+
+	/*
+	 * ts_push_pos only changes on FLUSH_STOP while the task is paused,
+	 * and here.
+	 */
+	flush_buffer = (self->ts_out_pos != self->ts_push_pos);
 
 	/* first clear pending events */
-	g_mutex_lock(self->ts_mutex);
-	while ((event = self->ts_array[self->ts_out_pos].event)) {
-		self->ts_array[self->ts_out_pos].event = NULL;
-		flush_buffer = (self->ts_out_pos != self->ts_push_pos);
-		self->ts_out_pos = (self->ts_out_pos + 1) % ARRAY_SIZE(self->ts_array);
-		if (G_LIKELY(!flush_buffer)) {
-			self->ts_push_pos = self->ts_out_pos;
-			pr_debug(self, "pushing event: %s", GST_EVENT_TYPE_NAME(event));
-			gst_pad_push_event(self->srcpad, event);
-		} else {
-			pr_debug(self, "ignored flushed event: %s", GST_EVENT_TYPE_NAME(event));
-			gst_event_unref(event);
-		}
-	}
-	g_mutex_unlock(self->ts_mutex);
+	if (item)
+		send_events(self, item, flush_buffer);
 
 	/* a pending reallocation from the previous run */
 	if (G_UNLIKELY(!b->data)) {
@@ -437,27 +1095,27 @@ output_loop(gpointer data)
 	if (G_UNLIKELY(!b->len)) {
 		/* no need to process this buffer */
 		/* no real frame data, so no need to consume a real frame's ts */
+		if (item)
+			g_atomic_int_inc(&self->ts_empty);
 		goto leave;
 	}
 
-	g_mutex_lock(self->ts_mutex);
-	flush_buffer = (self->ts_out_pos != self->ts_push_pos);
-	g_mutex_unlock(self->ts_mutex);
-
 	if (G_UNLIKELY(flush_buffer)) {
-		g_mutex_lock(self->ts_mutex);
 		pr_debug(self, "ignored flushed output buffer for %" GST_TIME_FORMAT,
-			 GST_TIME_ARGS((self->ts_array[self->ts_out_pos].time)));
-		self->ts_count--;
-		self->ts_out_pos = (self->ts_out_pos + 1) % ARRAY_SIZE(self->ts_array);
-		g_mutex_unlock(self->ts_mutex);
+			 GST_TIME_ARGS(item->time));
+		ts_pop(self);
 		goto leave;
 	}
 
 	/* now go after the data, but let's first see if it is keyframe */
 	keyframe = tb->keyframe;
 
-	if (self->use_pad_alloc) {
+	if (p->pool) {
+		out_buf = gst_dsp_buffer_new(self, tb);
+		/* the data belongs to out_buf now */
+		tb->data = b = gstdsp_pool_get(p->pool);
+	}
+	else if (self->use_pad_alloc) {
 		GstBuffer *new_buf;
 
 		ret = gst_pad_alloc_buffer_and_set_caps(self->srcpad,
@@ -482,6 +1140,7 @@ output_loop(gpointer data)
 		if (b->need_copy) {
 			pr_info(self, "copy");
 			memcpy(GST_BUFFER_DATA(out_buf), b->data, b->len);
+			dmm_stats_copy(b->stats);
 		}
 
 		GST_BUFFER_SIZE(out_buf) = b->len;
@@ -508,20 +1167,23 @@ output_loop(gpointer data)
 	if (!keyframe)
 		GST_BUFFER_FLAGS(out_buf) |= GST_BUFFER_FLAG_DELTA_UNIT;
 
-	g_mutex_lock(self->ts_mutex);
-	timestamp = self->ts_array[self->ts_out_pos].time;
-	duration = self->ts_array[self->ts_out_pos].duration;
-	self->ts_out_pos = (self->ts_out_pos + 1) % ARRAY_SIZE(self->ts_array);
-	self->ts_push_pos = self->ts_out_pos;
-	self->ts_count--;
+	timestamp = item->time;
+	duration = item->duration;
+	self->ts_push_pos = self->ts_out_pos + 1;
 
-	if (G_UNLIKELY(g_atomic_int_get(&self->deferred_eos)) && self->ts_count == 0)
-		got_eos = TRUE;
+	if (self->low_latency)
+		measure_latency(self, item);
+
+	/* sink_event checks the ring after deferring the EOS */
+	if (ts_pop(self) && G_UNLIKELY(g_atomic_int_get(&self->deferred_eos)))
+		got_eos = g_atomic_int_compare_and_exchange(&self->deferred_eos, true, false);
 #ifdef TS_COUNT
-	if (self->ts_count > 2 || self->ts_count < 1)
-		pr_info(self, "tsc=%lu", self->ts_count);
+	{
+		guint count = ts_get(&self->ts_in_pos) - self->ts_out_pos;
+		if (count > 2 || count < 1)
+			pr_info(self, "tsc=%u", count);
+	}
 #endif
-	g_mutex_unlock(self->ts_mutex);
 
 	if (!GST_CLOCK_TIME_IS_VALID(duration) && self->default_duration) {
 		duration = self->default_duration;
@@ -535,14 +1197,36 @@ output_loop(gpointer data)
 
 	pr_debug(self, "pushing buffer %" GST_TIME_FORMAT,
 		 GST_TIME_ARGS(GST_BUFFER_TIMESTAMP(out_buf)));
+	trace_add(self->trace, TRACE_PUSH, 0, GST_BUFFER_SIZE(out_buf));
 	ret = gst_pad_push(self->srcpad, out_buf);
 	if (G_UNLIKELY(ret != GST_FLOW_OK)) {
 		pr_info(self, "pad push failed: %s", gst_flow_get_name(ret));
 		goto leave;
 	}
 
+	post_stats(self);
+
 leave:
+	if (G_UNLIKELY(g_atomic_int_get(&self->draining)))
+		check_drained(self);
+
 	handled = tb->pinned && out_buf;
+	if (G_UNLIKELY(self->max_buffers) && !got_eos) {
+		struct td_buffer *extra = port_unpark(p);
+		if (extra)
+			setup_output_buffer(self, extra, false);
+		/* pinned ones downstream go back by themselves */
+		else if (!handled && port_park(p, tb)) {
+			if (tb->user_data) {
+				gst_buffer_unref(tb->user_data);
+				tb->user_data = NULL;
+			}
+			dmm_buffer_free(tb->data);
+			tb->data = NULL;
+			tb->pinned = false;
+			goto nok;
+		}
+	}
 	if (G_UNLIKELY(got_eos)) {
 		pr_info(self, "got eos");
 		self->eos_start.tv_sec = self->eos_start.tv_nsec = 0;
@@ -584,6 +1268,16 @@ end:
 	pr_debug(self, "end");
 }
 
+/* the input staging memory is about to be replaced */
+static inline void
+unpin_input(struct td_buffer *tb)
+{
+	if (!tb->pinned)
+		return;
+	dmm_buffer_unmap(tb->data);
+	tb->pinned = false;
+}
+
 void
 gstdsp_base_flush_buffer(GstDspBase *self)
 {
@@ -591,6 +1285,7 @@ gstdsp_base_flush_buffer(GstDspBase *self)
 	tb = async_queue_pop(self->ports[0]->queue);
 	if (!tb)
 		return;
+	unpin_input(tb);
 	dmm_buffer_allocate(tb->data, 1);
 	send_buffer(self, tb);
 }
@@ -609,74 +1304,384 @@ gstdsp_post_error(GstDspBase *self,
 	g_error_free(gerror);
 }
 
+/* by default to the temp dir, named after the element */
+static void
+dump_trace(GstDspBase *self,
+	   const char *filename)
+{
+	char *tmp = NULL;
+
+	if (!self->trace)
+		return;
+
+	if (!filename) {
+		char *name = g_strdup_printf("gstdsp-%s.trace", GST_OBJECT_NAME(self));
+		filename = tmp = g_build_filename(g_get_tmp_dir(), name, NULL);
+		g_free(name);
+	}
+
+	if (trace_dump(self->trace, filename))
+		pr_info(self, "trace dumped to %s", filename);
+	else
+		pr_warning(self, "couldn't dump trace to %s", filename);
+
+	g_free(tmp);
+}
+
+/* wake up right when the EOS is due */
+static inline unsigned
+wait_timeout(GstDspBase *self)
+{
+	long elapsed;
+
+	if (!self->eos_timeout || !self->eos_start.tv_sec)
+		return 1000;
+
+	elapsed = get_elapsed_eos(self);
+	if (elapsed >= self->eos_timeout)
+		return 1;
+	return MIN(self->eos_timeout - elapsed, 1000);
+}
+
+/*
+ * One thread waits for the DSP events of every element: the message-ready
+ * event of each running node, plus MMUFAULT and SYSERROR, which are the same
+ * for all. MGR_WAIT can't wait for anything userspace can signal, except
+ * DSP_PROCESSORATTACH, which every attach triggers, so that's how the
+ * thread is told the set of nodes changed. A node is removed only after the
+ * thread stopped waiting for it, since its event goes away with it. The
+ * thread and its attachment are kept until the last element goes away.
+ */
+
+#define DISPATCH_MAX_NODES 29 /* MGR_WAIT takes up to 32 events */
+
+static struct {
+	GMutex *lock; /* serializes adding and removing nodes */
+	GMutex *mutex;
+	GCond *cond;
+	GThread *thread;
+	int handle;
+	void *proc;
+	struct dsp_notification *events[3]; /* attach, mmufault, syserror */
+	GList *members;
+	guint changes, seen;
+	gboolean quit;
+	gboolean error; /* the attachment is gone with the DSP */
+	int waker; /* another handle, to attach with */
+	guint instances; /* the dispatcher lives as long as the elements */
+} dispatcher;
+
+static void
+dispatch_wake(void)
+{
+	void *proc;
+
+	if (dsp_attach(dispatcher.waker, 0, NULL, &proc))
+		dsp_detach(dispatcher.waker, proc);
+}
+
+/* what the element couldn't report from the dispatcher */
+static void
+report_error(GstDspBase *self)
+{
+	char *message;
+
+	do {
+		message = g_atomic_pointer_get(&self->pending_error);
+		if (!message)
+			return;
+	} while (!g_atomic_pointer_compare_and_exchange((gpointer *) &self->pending_error,
+							message, NULL));
+
+	pr_err(self, "%s", message);
+	gstdsp_post_error(self, message);
+
+	trace_add(self->trace, TRACE_ERROR, self->dsp_error, 0);
+	dump_trace(self, NULL);
+
+	g_free(message);
+}
+
+/*
+ * The dispatcher thread is shared, so it only marks the error; the element
+ * reports it from its own thread.
+ */
 void
 gstdsp_got_error(GstDspBase *self,
 	  guint id,
 	  const char *message)
 {
-	pr_err(self, "%s", message);
-	gstdsp_post_error(self, message);
+	char *tmp = g_strdup(message);
 
-	g_atomic_int_set(&self->status, GST_FLOW_ERROR);
+	/* the first one is the one that matters */
+	if (!g_atomic_pointer_compare_and_exchange((gpointer *) &self->pending_error,
+						   NULL, tmp))
+		g_free(tmp);
 	self->dsp_error = id;
+
+	if (g_thread_self() != dispatcher.thread)
+		report_error(self);
+
+	g_atomic_int_set(&self->status, GST_FLOW_ERROR);
 	async_queue_disable(self->ports[0]->queue);
 	async_queue_disable(self->ports[1]->queue);
 }
 
-static gpointer
-dsp_thread(gpointer data)
+static inline void
+check_eos_timeout(GstDspBase *self)
+{
+	long elapsed;
+
+	if (!self->eos_timeout || !self->eos_start.tv_sec)
+		return;
+
+	elapsed = get_elapsed_eos(self);
+	if (elapsed < self->eos_timeout)
+		return;
+
+	pr_err(self, "eos timed out after %lu ms", elapsed);
+	/* wind out of output loop */
+	g_atomic_int_set(&self->status, GST_FLOW_UNEXPECTED);
+	async_queue_disable(self->ports[1]->queue);
+	/* back to the normal timeout */
+	self->eos_start.tv_sec = self->eos_start.tv_nsec = 0;
+}
+
+static inline void
+get_messages(GstDspBase *self)
+{
+	struct dsp_msg msg;
+
+	while (!self->done) {
+		uint64_t start = self->trace ? trace_now() : 0;
+		if (!dsp_node_get_message(self->dsp_handle, self->node, &msg, 0))
+			break;
+		if (self->trace)
+			trace_ioctl(self, start, msg.cmd, true);
+		pr_debug(self, "got dsp message: 0x%0x 0x%0x 0x%0x",
+			 msg.cmd, msg.arg_1, msg.arg_2);
+		self->got_message(self, &msg);
+	}
+}
+
+static gpointer
+dispatch_thread(gpointer data)
+{
+	struct dsp_notification *events[DISPATCH_MAX_NODES + 3];
+	GstDspBase *members[DISPATCH_MAX_NODES];
+	unsigned count, timeout, index, i;
+	GList *l;
+
+	pr_info(NULL, "begin");
+
+	g_mutex_lock(dispatcher.mutex);
+	while (!dispatcher.quit) {
+		/* nodes out of this set can go away */
+		dispatcher.seen = dispatcher.changes;
+		g_cond_broadcast(dispatcher.cond);
+
+		count = 0;
+		timeout = 1000;
+		for (l = dispatcher.members; l; l = l->next) {
+			GstDspBase *self = l->data;
+			self->dispatched = !self->done;
+			if (self->done)
+				continue;
+			members[count] = self;
+			events[count++] = self->msg_event;
+			timeout = MIN(timeout, wait_timeout(self));
+		}
+		for (i = 0; i < ARRAY_SIZE(dispatcher.events); i++)
+			events[count + i] = dispatcher.events[i];
+		g_mutex_unlock(dispatcher.mutex);
+
+		pr_debug(NULL, "waiting for events of %u nodes", count);
+		index = 0;
+		if (!dsp_wait_for_events(dispatcher.handle, events, count + 3, &index, timeout)) {
+			if (errno != ETIME) {
+				pr_err(NULL, "failed waiting for events: %i", errno);
+				dispatcher.error = TRUE;
+				for (i = 0; i < count; i++) {
+					gstdsp_got_error(members[i], -1, "unable to get event");
+					members[i]->done = TRUE;
+				}
+				/* don't spin if it's not the nodes */
+				if (!count)
+					g_usleep(G_USEC_PER_SEC);
+			}
+			index = count + 3;
+		}
+
+		if (index < count)
+			get_messages(members[index]);
+		else if (index == count + 1 || index == count + 2) {
+			const char *error = index == count + 1 ? "got DSP MMUFAULT" : "got DSP SYSERROR";
+			dispatcher.error = TRUE;
+			for (i = 0; i < count; i++) {
+				gstdsp_got_error(members[i], index - count, error);
+				members[i]->done = TRUE;
+			}
+		}
+
+		for (i = 0; i < count; i++)
+			check_eos_timeout(members[i]);
+
+		g_mutex_lock(dispatcher.mutex);
+	}
+	dispatcher.seen = dispatcher.changes;
+	g_cond_broadcast(dispatcher.cond);
+	g_mutex_unlock(dispatcher.mutex);
+
+	pr_info(NULL, "end");
+
+	return NULL;
+}
+
+static void
+dispatch_stop(void)
+{
+	unsigned i;
+
+	if (dispatcher.thread) {
+		g_mutex_lock(dispatcher.mutex);
+		dispatcher.quit = TRUE;
+		g_mutex_unlock(dispatcher.mutex);
+		dispatch_wake();
+		g_thread_join(dispatcher.thread);
+		dispatcher.thread = NULL;
+	}
+
+	/* after a fault there's nothing to detach from */
+	if (dispatcher.proc && !dispatcher.error)
+		dsp_detach(dispatcher.handle, dispatcher.proc);
+	dispatcher.proc = NULL;
+	dispatcher.error = FALSE;
+	if (dispatcher.handle >= 0)
+		dsp_close(dispatcher.handle);
+	dispatcher.handle = -1;
+	if (dispatcher.waker >= 0)
+		dsp_close(dispatcher.waker);
+	dispatcher.waker = -1;
+
+	for (i = 0; i < ARRAY_SIZE(dispatcher.events); i++) {
+		free(dispatcher.events[i]);
+		dispatcher.events[i] = NULL;
+	}
+}
+
+static bool
+dispatch_start(void)
+{
+	static const unsigned int masks[] = {
+		DSP_PROCESSORATTACH, DSP_MMUFAULT, DSP_SYSERROR,
+	};
+	unsigned i;
+
+	dispatcher.handle = dsp_open();
+	dispatcher.waker = dsp_open();
+	if (dispatcher.handle < 0 || dispatcher.waker < 0) {
+		pr_err(NULL, "dsp open failed");
+		goto fail;
+	}
+
+	if (!dsp_attach(dispatcher.handle, 0, NULL, &dispatcher.proc)) {
+		pr_err(NULL, "dsp attach failed");
+		dispatcher.proc = NULL;
+		goto fail;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(masks); i++) {
+		dispatcher.events[i] = calloc(1, sizeof(struct dsp_notification));
+		if (!dsp_register_notify(dispatcher.handle, dispatcher.proc,
+					 masks[i], 1, dispatcher.events[i]))
+		{
+			pr_err(NULL, "failed to register for 0x%x", masks[i]);
+			goto fail;
+		}
+	}
+
+	dispatcher.quit = FALSE;
+	dispatcher.thread = g_thread_create(dispatch_thread, NULL, TRUE, NULL);
+	if (!dispatcher.thread)
+		goto fail;
+
+	return true;
+
+fail:
+	dispatch_stop();
+	return false;
+}
+
+static bool
+dispatch_add(GstDspBase *self)
+{
+	bool ret = true;
+
+	g_mutex_lock(dispatcher.lock);
+
+	/* a new attachment, once the nodes of the old one are gone */
+	if (dispatcher.error && !dispatcher.members)
+		dispatch_stop();
+
+	if (!dispatcher.thread && !dispatch_start()) {
+		ret = false;
+		goto leave;
+	}
+
+	g_mutex_lock(dispatcher.mutex);
+	if (dispatcher.error) {
+		pr_err(self, "the dsp had a fault");
+		ret = false;
+	} else if (g_list_length(dispatcher.members) >= DISPATCH_MAX_NODES) {
+		pr_err(self, "too many nodes");
+		ret = false;
+	} else {
+		dispatcher.members = g_list_prepend(dispatcher.members, self);
+		dispatcher.changes++;
+	}
+	g_mutex_unlock(dispatcher.mutex);
+
+	if (ret)
+		dispatch_wake();
+
+leave:
+	g_mutex_unlock(dispatcher.lock);
+	return ret;
+}
+
+/* returns once the dispatcher doesn't wait for this node */
+static void
+dispatch_remove(GstDspBase *self)
 {
-	GstDspBase *self = data;
+	guint change;
+	gboolean dispatched;
 
-	pr_info(self, "begin");
-
-	while (!self->done) {
-		unsigned int index = 0;
-		pr_debug(self, "waiting for events");
-		if (!dsp_wait_for_events(self->dsp_handle, self->events, 3, &index, 1000)) {
-			if (errno == ETIME) {
-				long elapsed = get_elapsed_eos(self);
-				pr_info(self, "timed out waiting for events");
-				if (self->eos_timeout && elapsed >= self->eos_timeout) {
-					pr_err(self, "eos timed out after %lu ms", elapsed);
-					/* wind out of output loop */
-					g_atomic_int_set(&self->status, GST_FLOW_UNEXPECTED);
-					async_queue_disable(self->ports[1]->queue);
-				}
-				continue;
-			}
-			pr_err(self, "failed waiting for events: %i", errno);
-			gstdsp_got_error(self, -1, "unable to get event");
-			break;
-		}
+	g_mutex_lock(dispatcher.lock);
 
-		if (index == 0) {
-			struct dsp_msg msg;
-			while (true) {
-				if (!dsp_node_get_message(self->dsp_handle, self->node, &msg, 10))
-					break;
-				pr_debug(self, "got dsp message: 0x%0x 0x%0x 0x%0x",
-					 msg.cmd, msg.arg_1, msg.arg_2);
-				self->got_message(self, &msg);
-			}
-		}
-		else if (index == 1) {
-			gstdsp_got_error(self, 1, "got DSP MMUFAULT");
-			break;
-		}
-		else if (index == 2) {
-			gstdsp_got_error(self, 2, "got DSP SYSERROR");
-			break;
-		}
-		else {
-			gstdsp_got_error(self, 3, "wrong event index");
-			break;
-		}
+	g_mutex_lock(dispatcher.mutex);
+	if (!g_list_find(dispatcher.members, self)) {
+		g_mutex_unlock(dispatcher.mutex);
+		goto leave;
 	}
+	dispatcher.members = g_list_remove(dispatcher.members, self);
+	change = ++dispatcher.changes;
+	dispatched = self->dispatched;
+	self->dispatched = FALSE;
+	g_mutex_unlock(dispatcher.mutex);
+
+	/* usually it saw the node was done already */
+	if (!dispatched)
+		goto leave;
 
-	pr_info(self, "end");
+	dispatch_wake();
 
-	return NULL;
+	g_mutex_lock(dispatcher.mutex);
+	while ((gint) (dispatcher.seen - change) < 0)
+		g_cond_wait(dispatcher.cond, dispatcher.mutex);
+	g_mutex_unlock(dispatcher.mutex);
+
+leave:
+	g_mutex_unlock(dispatcher.lock);
 }
 
 static inline bool
@@ -699,34 +1704,28 @@ dsp_init(GstDspBase *self)
 {
 	int dsp_handle;
 
-	self->dsp_handle = dsp_handle = dsp_open();
+	self->dsp_handle = dsp_handle = gstdsp_open(&self->proc);
 
 	if (dsp_handle < 0) {
 		pr_err(self, "dsp open failed");
 		return FALSE;
 	}
 
-	if (!dsp_attach(dsp_handle, 0, NULL, &self->proc)) {
-		pr_err(self, "dsp attach failed");
-		goto fail;
-	}
-
-	return TRUE;
+	/* the last counters stay readable until the next run */
+	dmm_stats_put(self->stats);
+	self->stats = dmm_stats_new(dsp_handle);
 
-fail:
-	if (self->proc) {
-		if (!dsp_detach(dsp_handle, self->proc))
-			pr_err(self, "dsp detach failed");
-		self->proc = NULL;
-	}
+	self->slab = dmm_slab_new(dsp_handle, self->proc);
 
-	if (self->dsp_handle >= 0) {
-		if (dsp_close(dsp_handle) < 0)
-			pr_err(self, "dsp close failed");
-		self->dsp_handle = -1;
+	/* kept after stopping, so it can still be dumped */
+	if (self->trace && self->trace->mask + 1 < self->trace_size) {
+		trace_free(self->trace);
+		self->trace = NULL;
 	}
+	if (!self->trace && self->trace_size)
+		self->trace = trace_new(self->trace_size);
 
-	return FALSE;
+	return TRUE;
 }
 
 static gboolean
@@ -734,26 +1733,19 @@ dsp_deinit(GstDspBase *self)
 {
 	gboolean ret = TRUE;
 
-	if (self->dsp_error)
-		goto leave;
-
-	if (self->proc) {
-		if (!dsp_detach(self->dsp_handle, self->proc)) {
-			pr_err(self, "dsp detach failed");
-			ret = FALSE;
-		}
-		self->proc = NULL;
-	}
+	dmm_slab_free(self->slab);
+	self->slab = NULL;
 
-leave:
+	dmm_stats_unregister(self->stats);
 
 	if (self->dsp_handle >= 0) {
-		if (dsp_close(self->dsp_handle) < 0) {
+		if (!gstdsp_close(self->dsp_handle, self->dsp_error)) {
 			pr_err(self, "dsp close failed");
 			ret = FALSE;
 		}
 		self->dsp_handle = -1;
 	}
+	self->proc = NULL;
 
 	return ret;
 }
@@ -761,27 +1753,58 @@ leave:
 static bool
 send_play_message(GstDspBase *self)
 {
-	return dsp_send_message(self->dsp_handle, self->node, 0x0100, 0, 0);
+	return send_message(self, self->node, 0x0100, 0, 0);
 };
 
-gboolean
-gstdsp_start(GstDspBase *self)
+static inline bool
+send_pending_codec_data(GstDspBase *self)
 {
 	struct td_codec *codec = self->codec;
+	GstBuffer *buf = self->codec_data;
 	bool ret = true;
+
+	if (!buf)
+		return true;
+
+	self->codec_data = NULL;
+
+	if (codec->handle_extra_data)
+		ret = codec->handle_extra_data(self, buf);
+	else
+		ret = gstdsp_send_codec_data(self, buf);
+
+	gst_buffer_unref(buf);
+
+	return ret;
+}
+
+gboolean
+gstdsp_start(GstDspBase *self)
+{
+	struct batch batch;
+	bool ret;
 	guint i;
 
+	/* the comm buffers live as long as the node, so they can use its memory */
+	if (self->use_shm && !dmm_slab_use_shm(self->slab, self->node))
+		pr_warning(self, "couldn't use shared memory");
+
 	for (i = 0; i < ARRAY_SIZE(self->ports); i++) {
 		du_port_t *p = self->ports[i];
 		guint j;
 		for (j = 0; j < p->num_buffers; j++) {
 			struct td_buffer *tb = &p->buffers[j];
-			tb->comm = dmm_buffer_new(self->dsp_handle, self->proc, DMA_BIDIRECTIONAL);
-			dmm_buffer_allocate(tb->comm, sizeof(*tb->comm));
+			tb->comm = dmm_slab_calloc(self->slab, sizeof(dsp_comm_t), DMA_BIDIRECTIONAL);
 			dmm_buffer_map(tb->comm);
 		}
 	}
 
+	dmm_slab_use_shm(self->slab, NULL);
+
+	if (self->map_cache_size)
+		self->map_cache = dmm_cache_new(self->dsp_handle, self->proc,
+						self->map_cache_size);
+
 	if (!dsp_node_run(self->dsp_handle, self->node)) {
 		pr_err(self, "dsp node run failed");
 		return false;
@@ -789,52 +1812,41 @@ gstdsp_start(GstDspBase *self)
 
 	pr_info(self, "dsp node running");
 
-	self->events[0] = calloc(1, sizeof(struct dsp_notification));
+	self->msg_event = calloc(1, sizeof(struct dsp_notification));
 	if (!dsp_node_register_notify(self->dsp_handle, self->node,
 				      DSP_NODEMESSAGEREADY, 1,
-				      self->events[0]))
+				      self->msg_event))
 	{
 		pr_err(self, "failed to register for notifications");
 		return false;
 	}
 
-	self->events[1] = calloc(1, sizeof(struct dsp_notification));
-	if (!dsp_register_notify(self->dsp_handle, self->proc,
-				 DSP_MMUFAULT, 1,
-				 self->events[1]))
+	/* enough for all the buffers in flight; it's empty now */
+	if (self->ts_ring->mask + 1 < self->ports[0]->num_buffers +
+	    self->ports[1]->num_buffers + TS_HEADROOM &&
+	    self->ts_in_pos == self->ts_out_pos)
 	{
-		pr_err(self, "failed to register for DSP_MMUFAULT");
-		return false;
+		g_free(self->ts_ring);
+		self->ts_ring = ts_ring_new(self->ports[0]->num_buffers +
+					    self->ports[1]->num_buffers + TS_HEADROOM);
 	}
 
-	self->events[2] = calloc(1, sizeof(struct dsp_notification));
-	if (!dsp_register_notify(self->dsp_handle, self->proc,
-				 DSP_SYSERROR, 1,
-				 self->events[2]))
-	{
-		pr_err(self, "failed to register for DSP_SYSERROR");
+	if (!dispatch_add(self)) {
+		pr_err(self, "failed to wait for dsp events");
 		return false;
 	}
-
-	pr_info(self, "creating dsp thread");
-	self->dsp_thread = g_thread_create(dsp_thread, self, TRUE, NULL);
 	gst_pad_start_task(self->srcpad, output_loop, self->srcpad);
 
+	/* the play message, all the output buffers, and the codec data */
+	batch_begin(self, &batch);
+
 	self->send_play_message(self);
 
 	setup_buffers(self);
 
-	if (self->codec_data) {
-		GstBuffer *buf = self->codec_data;
-		self->codec_data = NULL;
+	ret = send_pending_codec_data(self);
 
-		if (codec->handle_extra_data)
-			ret = codec->handle_extra_data(self, buf);
-		else
-			ret = gstdsp_send_codec_data(self, buf);
-
-		gst_buffer_unref(buf);
-	}
+	batch_end(&batch);
 
 	return ret;
 }
@@ -845,7 +1857,6 @@ send_stop_message(GstDspBase *self)
 	if (dsp_send_message(self->dsp_handle, self->node, 0x0200, 0, 0))
 		if (!g_sem_down_timed(self->flush, 2))
 			pr_warning(self, "timed out waiting for DSP STOP");
-	/** @todo find a way to stop wait_for_events */
 	return true;
 };
 
@@ -863,12 +1874,16 @@ _dsp_stop(GstDspBase *self)
 		self->done = TRUE;
 	}
 
-	g_thread_join(self->dsp_thread);
+	dispatch_remove(self);
 	gst_pad_stop_task(self->srcpad);
+	report_error(self);
 
 	for (i = 0; i < ARRAY_SIZE(self->ports); i++)
 		du_port_flush(self->ports[i]);
 
+	dmm_cache_free(self->map_cache);
+	self->map_cache = NULL;
+
 	for (i = 0; i < ARRAY_SIZE(self->ports); i++) {
 		guint j;
 		du_port_t *port = self->ports[i];
@@ -878,21 +1893,15 @@ _dsp_stop(GstDspBase *self)
 		}
 	}
 
-	for (i = 0; i < ARRAY_SIZE(self->ts_array); i++) {
-		if (self->ts_array[i].event) {
-			gst_event_unref(self->ts_array[i].event);
-			self->ts_array[i].event = NULL;
-		}
-	}
-	self->ts_in_pos = self->ts_out_pos = self->ts_push_pos = 0;
-	self->ts_count = 0;
+	ts_reset(self);
 	self->skip_hack = 0;
 	self->skip_hack_2 = 0;
+	self->input_headroom = 0;
+	self->transform_input = FALSE;
+	self->latency = self->latency_reported = 0;
 
-	for (i = 0; i < ARRAY_SIZE(self->events); i++) {
-		free(self->events[i]);
-		self->events[i] = NULL;
-	}
+	free(self->msg_event);
+	self->msg_event = NULL;
 
 	if (self->alg_ctrl) {
 		dmm_buffer_free(self->alg_ctrl);
@@ -906,11 +1915,7 @@ _dsp_stop(GstDspBase *self)
 		pr_err(self, "dsp node terminate failed: 0x%lx", exit_status);
 
 leave:
-	if (!destroy_node(self))
-		pr_err(self, "dsp node destroy failed");
-
-	self->node = NULL;
-
+	/* the shared memory goes with the node */
 	for (i = 0; i < ARRAY_SIZE(self->ports); i++) {
 		du_port_t *p = self->ports[i];
 		guint j;
@@ -918,8 +1923,16 @@ leave:
 			dmm_buffer_free(p->buffers[j].comm);
 			p->buffers[j].comm = NULL;
 		}
-		du_port_alloc_buffers(p, 0);
 	}
+	dmm_slab_drop_shm(self->slab);
+
+	if (!destroy_node(self))
+		pr_err(self, "dsp node destroy failed");
+
+	self->node = NULL;
+
+	for (i = 0; i < ARRAY_SIZE(self->ports); i++)
+		du_port_alloc_buffers(self->ports[i], 0);
 
 	pr_info(self, "dsp node terminated");
 
@@ -950,6 +1963,72 @@ gboolean gstdsp_reinit(GstDspBase *self)
 	return true;
 }
 
+/*
+ * Get every frame out of the node, so it can go on with other stream
+ * parameters, as long as they fit in what it was created for. Called from
+ * the streaming thread; output_loop does the rest.
+ */
+gboolean
+gstdsp_drain(GstDspBase *self)
+{
+	if (!self->node)
+		return FALSE;
+
+	/* not the end of the stream, just of these parameters */
+	g_atomic_int_set(&self->deferred_eos, false);
+	g_atomic_int_set(&self->eos, false);
+
+	g_atomic_int_set(&self->draining, true);
+
+	if (self->flush_buffer)
+		self->flush_buffer(self);
+	else if (self->ts_in_pos - ts_get(&self->ts_out_pos) <=
+		 (guint) g_atomic_int_get(&self->ts_empty))
+	{
+		/* nothing on the way */
+		if (g_atomic_int_compare_and_exchange(&self->draining, true, false))
+			return TRUE;
+	}
+
+	if (!g_sem_down_timed(self->drained, DRAIN_TIMEOUT)) {
+		if (g_atomic_int_compare_and_exchange(&self->draining, true, false)) {
+			pr_warning(self, "timed out draining");
+			return FALSE;
+		}
+		/* it just finished */
+		g_sem_down(self->drained);
+	}
+
+	return g_atomic_int_get(&self->status) == GST_FLOW_OK;
+}
+
+/* the new parameters, and codec data, for a drained node */
+gboolean
+gstdsp_reconfigure(GstDspBase *self)
+{
+	struct td_codec *codec = self->codec;
+	struct batch batch;
+	bool ret;
+
+	pr_info(self, "reusing node");
+
+	if (self->tmp_caps && !gst_pad_set_caps(self->srcpad, self->tmp_caps)) {
+		pr_err(self, "couldn't setup output caps");
+		return FALSE;
+	}
+
+	batch_begin(self, &batch);
+
+	if (codec->send_params)
+		codec->send_params(self, self->node);
+
+	ret = send_pending_codec_data(self);
+
+	batch_end(&batch);
+
+	return ret;
+}
+
 static inline void
 map_buffer(GstDspBase *self,
 	   GstBuffer *g_buf,
@@ -976,11 +2055,18 @@ static inline bool send_buffer(GstDspBase *self, struct td_buffer *tb)
 	if (tb->params)
 		dmm_buffer_begin(tb->params, tb->params->size);
 
+	if (index != 0)
+		buffer->no_cpu_access = !self->output_cpu_access && !buffer->need_copy;
+
 	if (tb->pinned) {
+		/* the DSP might write more output than it did last time */
 		if (G_LIKELY(!tb->clean))
-			dmm_buffer_begin(buffer, buffer->len);
+			dmm_buffer_begin(buffer, index == 0 ? buffer->len : buffer->size);
 		else
 			tb->clean = false;
+	} else if (self->map_cache && buffer->data != buffer->allocated_data) {
+		/* not our memory; it might come back */
+		dmm_cache_map(self->map_cache, buffer);
 	} else {
 		dmm_buffer_map(buffer);
 	}
@@ -1000,10 +2086,16 @@ static inline bool send_buffer(GstDspBase *self, struct td_buffer *tb)
 		msg_data->param_virt = (uint32_t) tb->params;
 	}
 
-	dmm_buffer_begin(tb->comm, sizeof(*msg_data));
+	send_comm(self, tb->comm);
+
+	if (G_UNLIKELY(self->max_buffers)) {
+		tb->sent = gst_util_get_timestamp();
+		g_atomic_int_inc(&port->in_dsp);
+	}
 
-	dsp_send_message(self->dsp_handle, self->node,
-			 0x0600 | port->id, (uint32_t) tb->comm->map, 0);
+	trace_add(self->trace, TRACE_SEND, index, msg_data->buffer_len);
+	send_message(self, self->node,
+		     0x0600 | port->id, (uint32_t) tb->comm->map, 0);
 
 	return true;
 }
@@ -1015,8 +2107,7 @@ gstdsp_send_alg_ctrl(GstDspBase *self,
 {
 	self->alg_ctrl = b;
 	dmm_buffer_map(b);
-	dsp_send_message(self->dsp_handle, node,
-			 0x0400, 3, (uint32_t) b->map);
+	send_message(self, node, 0x0400, 3, (uint32_t) b->map);
 }
 
 static GstStateChangeReturn
@@ -1065,7 +2156,13 @@ change_state(GstElement *element,
 		return ret;
 
 	switch (transition) {
+	case GST_STATE_CHANGE_READY_TO_PAUSED:
+		if (self->prewarm_caps)
+			prewarm_start(self);
+		break;
+
 	case GST_STATE_CHANGE_PAUSED_TO_READY:
+		prewarm_finish(self, NULL);
 		if (!_dsp_stop(self)) {
 			gstdsp_post_error(self, "dsp stop failed");
 			return GST_STATE_CHANGE_FAILURE;
@@ -1089,6 +2186,24 @@ change_state(GstElement *element,
 	return ret;
 }
 
+/* the node gets max-buffers; the element's own counts are where to start */
+static inline void
+adapt_setup(GstDspBase *self)
+{
+	guint i, max, min;
+
+	max = MIN(self->max_buffers, DU_PORT_MAX_BUFFERS);
+	min = MIN(self->min_buffers, max);
+
+	for (i = 0; i < ARRAY_SIZE(self->ports); i++) {
+		du_port_t *p = self->ports[i];
+		guint active = CLAMP(p->num_buffers, min, max);
+
+		du_port_alloc_buffers(p, max);
+		p->active = active;
+	}
+}
+
 static inline gboolean
 init_node(GstDspBase *self,
 	  GstBuffer *buf)
@@ -1097,7 +2212,7 @@ init_node(GstDspBase *self,
 		if (self->codec_data && self->parse_func(self, self->codec_data))
 			goto ok;
 
-		if (self->parse_func(self, buf))
+		if (buf && self->parse_func(self, buf))
 			goto ok;
 
 		pr_err(self, "error while parsing");
@@ -1120,6 +2235,14 @@ ok:
 	if (!self->output_buffer_size)
 		return FALSE;
 
+	if (self->low_latency) {
+		guint i;
+		for (i = 0; i < ARRAY_SIZE(self->ports); i++)
+			du_port_alloc_buffers(self->ports[i], 1);
+	}
+	else if (self->max_buffers)
+		adapt_setup(self);
+
 	self->node = self->create_node(self);
 	if (!self->node) {
 		pr_err(self, "dsp node creation failed");
@@ -1150,6 +2273,7 @@ gstdsp_send_codec_data(GstDspBase *self,
 	/* there should always be one available, as we are just starting */
 	g_assert(tb);
 
+	unpin_input(tb);
 	dmm_buffer_allocate(tb->data, GST_BUFFER_SIZE(buf));
 	memcpy(tb->data->data, GST_BUFFER_DATA(buf), GST_BUFFER_SIZE(buf));
 
@@ -1184,26 +2308,28 @@ static gboolean base_query(GstPad *pad, GstQuery *query)
 			frame_duration = base->default_duration;
 		} else {
 			GstClockTime c, first, last;
-			unsigned i, count = 0;
+			struct ts_ring *ring;
+			unsigned i, in, count = 0;
 
-			/* find first and last timestamps */
-			g_mutex_lock(base->ts_mutex);
+			/* find first and last timestamps; a rough snapshot is enough */
+			i = ts_get(&base->ts_out_pos);
+			in = ts_get(&base->ts_in_pos);
+			ring = *(struct ts_ring * volatile *) &base->ts_ring;
+			if (in - i > ring->mask)
+				i = in - ring->mask;
 
-			i = base->ts_out_pos;
-			first = last = base->ts_array[i].time;
+			first = last = ring->items[i & ring->mask].time;
 
-			while (i != base->ts_in_pos) {
-				c = base->ts_array[i].time;
+			while (i != in) {
+				c = ring->items[i & ring->mask].time;
 				if (c < first)
 					first = c;
 				if (c > last)
 					last = c;
-				i = (i + 1) % ARRAY_SIZE(base->ts_array);
+				i++;
 				count++;
 			}
 
-			g_mutex_unlock(base->ts_mutex);
-
 			if (count > 0)
 				frame_duration = (last - first) / count;
 			else
@@ -1214,7 +2340,14 @@ static gboolean base_query(GstPad *pad, GstQuery *query)
 				frame_duration = GST_SECOND;
 		}
 
-		if (base->codec->get_latency) {
+		if (base->low_latency && base->latency_reported) {
+			/* what it really takes, rather than an estimate */
+			if (GST_CLOCK_TIME_IS_VALID(min))
+				min += base->latency_reported;
+			if (GST_CLOCK_TIME_IS_VALID(max))
+				max += base->latency_reported;
+		}
+		else if (base->codec->get_latency) {
 			GstClockTime latency;
 
 			latency = base->codec->get_latency(base, frame_duration / 1000000) * 1000000;
@@ -1259,6 +2392,103 @@ gstdsp_set_codec_data_caps(GstDspBase *base,
 	return gst_pad_take_caps(base->srcpad, caps);
 }
 
+/*
+ * Prewarming: with prewarm-caps, the node is created and started on a
+ * separate thread as soon as the element goes to PAUSED, the same way the
+ * element would do it for those caps, so the DSP load overlaps with the
+ * preroll of upstream. The streaming thread waits for it before touching
+ * anything, and if the real caps turn out to be different, the node is
+ * thrown away.
+ */
+
+static gpointer
+prewarm(gpointer data)
+{
+	GstDspBase *self = data;
+
+	pr_info(self, "creating node ahead of time");
+
+	if (!self->sink_setcaps(self->sinkpad, self->prewarm_caps))
+		goto fail;
+	if (!self->node && !init_node(self, NULL))
+		goto fail;
+
+	pr_info(self, "node ready");
+	return NULL;
+
+fail:
+	pr_warning(self, "couldn't prewarm node");
+	if (self->node)
+		gstdsp_reinit(self);
+	return NULL;
+}
+
+static void
+prewarm_finish(GstDspBase *self,
+	       GstCaps *caps)
+{
+	if (!self->prewarm_thread)
+		return;
+
+	g_thread_join(self->prewarm_thread);
+	self->prewarm_thread = NULL;
+
+	if (self->node && caps && !gst_caps_is_subset(caps, self->prewarm_caps)) {
+		pr_info(self, "prewarmed node doesn't fit the caps");
+		gstdsp_reinit(self);
+	}
+}
+
+static gboolean
+prewarm_setcaps(GstPad *pad,
+		GstCaps *caps)
+{
+	GstDspBase *self = GST_DSP_BASE(GST_PAD_PARENT(pad));
+
+	prewarm_finish(self, caps);
+	return self->sink_setcaps(pad, caps);
+}
+
+static void
+prewarm_start(GstDspBase *self)
+{
+	GstPadSetCapsFunction setcaps = GST_PAD_SETCAPSFUNC(self->sinkpad);
+
+	if (!setcaps)
+		return;
+
+	/* the element's setcaps has to wait for us too */
+	if (setcaps != prewarm_setcaps) {
+		self->sink_setcaps = setcaps;
+		gst_pad_set_setcaps_function(self->sinkpad, prewarm_setcaps);
+	}
+
+	self->prewarm_thread = g_thread_create(prewarm, self, TRUE, NULL);
+}
+
+/*
+ * Whether the buffer's own memory goes on for a whole frame, so the DSP can
+ * have all of it; pages might be shared with anything else.
+ */
+static inline bool
+fits_in_allocation(GstBuffer *buf,
+		   size_t size)
+{
+	char *data = (char *) GST_BUFFER_DATA(buf);
+	char *start = (char *) GST_BUFFER_MALLOCDATA(buf);
+	size_t room;
+
+	room = gst_dsp_buffer_room(buf);
+	/* only plain malloc() memory knows its size */
+	if (!room && start && data >= start && GST_BUFFER_FREE_FUNC(buf) == g_free) {
+		size_t usable = malloc_usable_size(start);
+		if (data < start + usable)
+			room = start + usable - data;
+	}
+
+	return room >= size;
+}
+
 static GstFlowReturn
 pad_chain(GstPad *pad,
 	  GstBuffer *buf)
@@ -1274,6 +2504,11 @@ pad_chain(GstPad *pad,
 
 	pr_debug(self, "begin");
 
+	trace_add(self->trace, TRACE_CHAIN, 0, GST_BUFFER_SIZE(buf));
+
+	if (G_UNLIKELY(self->prewarm_thread))
+		prewarm_finish(self, NULL);
+
 	if (self->pre_process_buffer)
 		self->pre_process_buffer(self, buf);
 
@@ -1285,6 +2520,9 @@ pad_chain(GstPad *pad,
 		}
 	}
 
+	if (self->trace)
+		trace_add(self->trace, TRACE_QUEUE, 0, async_queue_length(p->queue));
+
 	tb = async_queue_pop(p->queue);
 
 	ret = g_atomic_int_get(&self->status);
@@ -1297,24 +2535,44 @@ pad_chain(GstPad *pad,
 
 	b = tb->data;
 
-	if (GST_BUFFER_SIZE(buf) >= self->input_buffer_size)
+	if (self->input_headroom) {
+		/* the codec rewrites the data in place */
+		unpin_input(tb);
+		dmm_buffer_allocate_headroom(b, GST_BUFFER_SIZE(buf), self->input_headroom);
+	} else if (GST_BUFFER_SIZE(buf) >= self->input_buffer_size) {
+		unpin_input(tb);
 		map_buffer(self, buf, tb);
-	else {
+	} else if (self->map_undersized && fits_in_allocation(buf, self->input_buffer_size)) {
+		/* the rest of the frame is in the buffer's own memory */
+		unpin_input(tb);
+		map_buffer(self, buf, tb);
+		b->len = b->size = self->input_buffer_size;
+	} else if (!self->pin_input || self->transform_input) {
+		/* the codec would replace pinned memory under the mapping */
+		unpin_input(tb);
 		dmm_buffer_allocate(b, self->input_buffer_size);
 		b->need_copy = true;
+	} else {
+		/* staging memory, mapped once and reused while it fits */
+		if (!tb->pinned || b->size < self->input_buffer_size) {
+			unpin_input(tb);
+			dmm_buffer_allocate_frame(b, self->input_buffer_size);
+			dmm_buffer_map(b);
+			b->track_dirty = true;
+			tb->pinned = true;
+		}
+		b->len = self->input_buffer_size;
+		b->need_copy = true;
 	}
 
 	if (b->need_copy) {
 		pr_info(self, "copy");
 		memcpy(b->data, GST_BUFFER_DATA(buf), GST_BUFFER_SIZE(buf));
+		dmm_buffer_dirty(b, 0, GST_BUFFER_SIZE(buf));
+		dmm_stats_copy(b->stats);
 	}
 
-	g_mutex_lock(self->ts_mutex);
-	self->ts_array[self->ts_in_pos].time = GST_BUFFER_TIMESTAMP(buf);
-	self->ts_array[self->ts_in_pos].duration = GST_BUFFER_DURATION(buf);
-	self->ts_in_pos = (self->ts_in_pos + 1) % ARRAY_SIZE(self->ts_array);
-	self->ts_count++;
-	g_mutex_unlock(self->ts_mutex);
+	ts_push(self, GST_BUFFER_TIMESTAMP(buf), GST_BUFFER_DURATION(buf));
 
 	self->send_buffer(self, tb);
 
@@ -1337,19 +2595,26 @@ sink_event(GstDspBase *self,
 
 	switch (GST_EVENT_TYPE(event)) {
 	case GST_EVENT_EOS: {
-		bool defer_eos = false;
+		bool defer_eos = true, claimed = false;
 
-		g_mutex_lock(self->ts_mutex);
-		if (self->ts_count != 0)
-			defer_eos = true;
-		if (self->status != GST_FLOW_OK)
+		/*
+		 * Defer first, then check; output_loop and pause_task do it the
+		 * other way around, so one side always sees the other, and
+		 * whoever clears the flag sends the EOS.
+		 */
+		g_atomic_int_set(&self->deferred_eos, true);
+		if (ts_get(&self->ts_out_pos) == self->ts_in_pos ||
+		    g_atomic_int_get(&self->status) != GST_FLOW_OK) {
 			defer_eos = false;
-		g_atomic_int_set(&self->deferred_eos, defer_eos);
-		g_mutex_unlock(self->ts_mutex);
+			claimed = !g_atomic_int_compare_and_exchange(&self->deferred_eos, true, false);
+		}
 
-		if (defer_eos) {
+		if (claimed)
+			gst_event_unref(event);
+		else if (defer_eos) {
 			clock_gettime(CLOCK_MONOTONIC, &self->eos_start);
-			if (self->flush_buffer)
+			/* nothing is held back for reordering */
+			if (self->flush_buffer && !self->low_latency)
 				self->flush_buffer(self);
 			gst_event_unref(event);
 		} else {
@@ -1374,12 +2639,14 @@ sink_event(GstDspBase *self,
 
 		g_atomic_int_set(&self->eos, false);
 
-		g_mutex_lock(self->ts_mutex);
-		self->ts_push_pos = self->ts_in_pos;
+		/* the task is paused */
+		ts_set(&self->ts_push_pos, self->ts_in_pos);
 		pr_debug(self, "flushing next %u buffer(s)",
 			 self->ts_push_pos - self->ts_out_pos);
+		self->ts_empty = 0;
+		ts_free_events(self->ts_events);
+		self->ts_events = NULL;
 		g_atomic_int_set(&self->deferred_eos, false);
-		g_mutex_unlock(self->ts_mutex);
 
 		g_atomic_int_set(&self->status, GST_FLOW_OK);
 		async_queue_enable(self->ports[0]->queue);
@@ -1389,17 +2656,11 @@ sink_event(GstDspBase *self,
 		break;
 
 	case GST_EVENT_NEWSEGMENT:
-		g_mutex_lock(self->ts_mutex);
 		pr_debug(self, "storing event");
-		self->ts_array[self->ts_in_pos].event = event;
-		self->ts_in_pos = (self->ts_in_pos + 1) % ARRAY_SIZE(self->ts_array);
-		g_mutex_unlock(self->ts_mutex);
+		self->ts_events = g_slist_prepend(self->ts_events, event);
 		break;
 
-	/*
-	 * FIXME maybe serialize some more events ??,
-	 * but that may need more than a fixed size queue
-	 */
+	/* FIXME maybe serialize some more events ?? */
 
 	default:
 		ret = gst_pad_push_event(self->srcpad, event);
@@ -1427,6 +2688,9 @@ base_sink_event(GstPad *pad,
 	self = GST_DSP_BASE(gst_pad_get_parent(pad));
 	class = GST_DSP_BASE_GET_CLASS(self);
 
+	if (G_UNLIKELY(self->prewarm_thread))
+		prewarm_finish(self, NULL);
+
 	if (class->sink_event)
 		ret = class->sink_event(self, event);
 
@@ -1490,10 +2754,26 @@ instance_init(GTypeInstance *instance,
 	gst_element_add_pad(GST_ELEMENT(self), self->sinkpad);
 	gst_element_add_pad(GST_ELEMENT(self), self->srcpad);
 
-	self->ts_mutex = g_mutex_new();
+	self->ts_ring = ts_ring_new(TS_HEADROOM);
 
 	self->flush = g_sem_new(0);
+	self->drained = g_sem_new(0);
 	self->eos_timeout = 1000;
+	self->map_cache_size = DEFAULT_MAP_CACHE_SIZE;
+	self->use_pool = TRUE;
+	self->pin_input = TRUE;
+	self->map_undersized = DEFAULT_MAP_UNDERSIZED;
+	self->output_cpu_access = DEFAULT_OUTPUT_CPU_ACCESS;
+	self->use_shm = DEFAULT_SHARED_MEMORY;
+	self->stats_interval = DEFAULT_STATS_INTERVAL;
+	self->min_buffers = DEFAULT_MIN_BUFFERS;
+	self->max_buffers = DEFAULT_MAX_BUFFERS;
+	self->low_latency = DEFAULT_LOW_LATENCY;
+	self->trace_size = DEFAULT_TRACE_SIZE;
+
+	g_mutex_lock(dispatcher.lock);
+	dispatcher.instances++;
+	g_mutex_unlock(dispatcher.lock);
 }
 
 static void
@@ -1504,15 +2784,163 @@ finalize(GObject *obj)
 	self = GST_DSP_BASE(obj);
 
 	g_sem_free(self->flush);
+	g_sem_free(self->drained);
 
-	g_mutex_free(self->ts_mutex);
+	ts_reset(self);
+	g_free(self->ts_ring);
 
 	du_port_free(self->ports[1]);
 	du_port_free(self->ports[0]);
 
+	dmm_stats_put(self->stats);
+	gst_caps_replace(&self->prewarm_caps, NULL);
+	trace_free(self->trace);
+	g_free(self->pending_error);
+
+	g_mutex_lock(dispatcher.lock);
+	if (--dispatcher.instances == 0 && dispatcher.thread)
+		dispatch_stop();
+	g_mutex_unlock(dispatcher.lock);
+
 	G_OBJECT_CLASS(parent_class)->finalize(obj);
 }
 
+static void
+set_property(GObject *obj,
+	     guint prop_id,
+	     const GValue *value,
+	     GParamSpec *pspec)
+{
+	GstDspBase *self = GST_DSP_BASE(obj);
+
+	switch (prop_id) {
+	case ARG_MAP_CACHE_SIZE:
+		self->map_cache_size = g_value_get_ulong(value);
+		break;
+	case ARG_MAP_UNDERSIZED:
+		self->map_undersized = g_value_get_boolean(value);
+		break;
+	case ARG_OUTPUT_CPU_ACCESS:
+		self->output_cpu_access = g_value_get_boolean(value);
+		break;
+	case ARG_SHARED_MEMORY:
+		self->use_shm = g_value_get_boolean(value);
+		break;
+	case ARG_STATS_INTERVAL:
+		self->stats_interval = g_value_get_uint(value);
+		break;
+	case ARG_PREWARM_CAPS:
+		gst_caps_replace(&self->prewarm_caps, (GstCaps *) g_value_get_boxed(value));
+		break;
+	case ARG_MIN_BUFFERS:
+		self->min_buffers = g_value_get_uint(value);
+		break;
+	case ARG_MAX_BUFFERS:
+		self->max_buffers = g_value_get_uint(value);
+		break;
+	case ARG_LOW_LATENCY:
+		self->low_latency = g_value_get_boolean(value);
+		break;
+	case ARG_TRACE_SIZE:
+		self->trace_size = g_value_get_uint(value);
+		break;
+	case ARG_TRACE_FILE:
+		dump_trace(self, g_value_get_string(value));
+		break;
+	case ARG_IOCTL_STATS:
+		dsp_ioctl_stats_enable(g_value_get_boolean(value));
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID(obj, prop_id, pspec);
+		break;
+	}
+}
+
+static void
+get_property(GObject *obj,
+	     guint prop_id,
+	     GValue *value,
+	     GParamSpec *pspec)
+{
+	GstDspBase *self = GST_DSP_BASE(obj);
+	struct dmm_stats *stats = self->stats;
+
+	switch (prop_id) {
+	case ARG_MAP_CACHE_SIZE:
+		g_value_set_ulong(value, self->map_cache_size);
+		break;
+	case ARG_MAP_UNDERSIZED:
+		g_value_set_boolean(value, self->map_undersized);
+		break;
+	case ARG_OUTPUT_CPU_ACCESS:
+		g_value_set_boolean(value, self->output_cpu_access);
+		break;
+	case ARG_SHARED_MEMORY:
+		g_value_set_boolean(value, self->use_shm);
+		break;
+	case ARG_STATS_INTERVAL:
+		g_value_set_uint(value, self->stats_interval);
+		break;
+	case ARG_PREWARM_CAPS:
+		g_value_set_boxed(value, self->prewarm_caps);
+		break;
+	case ARG_MIN_BUFFERS:
+		g_value_set_uint(value, self->min_buffers);
+		break;
+	case ARG_MAX_BUFFERS:
+		g_value_set_uint(value, self->max_buffers);
+		break;
+	case ARG_LOW_LATENCY:
+		g_value_set_boolean(value, self->low_latency);
+		break;
+	case ARG_TRACE_SIZE:
+		g_value_set_uint(value, self->trace_size);
+		break;
+	case ARG_IOCTL_STATS:
+		g_value_set_boolean(value, dsp_ioctl_stats_enabled);
+		break;
+	case ARG_LIVE_MAPPINGS:
+		g_value_set_ulong(value, stats ? stats->maps : 0);
+		break;
+	case ARG_MAPPED_BYTES:
+		g_value_set_ulong(value, stats ? stats->mapped : 0);
+		break;
+	case ARG_PEAK_MAPPED_BYTES:
+		g_value_set_ulong(value, stats ? stats->peak_mapped : 0);
+		break;
+	case ARG_RESERVED_BYTES:
+		g_value_set_ulong(value, stats ? stats->reserved : 0);
+		break;
+	case ARG_PEAK_RESERVED_BYTES:
+		g_value_set_ulong(value, stats ? stats->peak_reserved : 0);
+		break;
+	case ARG_RESERVE_CALLS:
+		g_value_set_ulong(value, stats ? stats->reserve_calls : 0);
+		break;
+	case ARG_MAP_CALLS:
+		g_value_set_ulong(value, stats ? stats->map_calls : 0);
+		break;
+	case ARG_COPIES:
+		g_value_set_ulong(value, stats ? stats->copies : 0);
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID(obj, prop_id, pspec);
+		break;
+	}
+}
+
+static inline void
+install_counter(GObjectClass *gobject_class,
+		guint prop_id,
+		const gchar *name,
+		const gchar *blurb)
+{
+	g_object_class_install_property(gobject_class, prop_id,
+					g_param_spec_ulong(name, name, blurb,
+							   0, G_MAXULONG, 0,
+							   G_PARAM_READABLE));
+}
+
 static void
 class_init(gpointer g_class,
 	   gpointer class_data)
@@ -1526,8 +2954,119 @@ class_init(gpointer g_class,
 	gobject_class = G_OBJECT_CLASS(g_class);
 	class = GST_DSP_BASE_CLASS(g_class);
 
+	dispatcher.lock = g_mutex_new();
+	dispatcher.mutex = g_mutex_new();
+	dispatcher.cond = g_cond_new();
+	dispatcher.handle = -1;
+	dispatcher.waker = -1;
+
 	gstelement_class->change_state = change_state;
 	gobject_class->finalize = finalize;
+	gobject_class->set_property = set_property;
+	gobject_class->get_property = get_property;
+
+	g_object_class_install_property(gobject_class, ARG_MAP_CACHE_SIZE,
+					g_param_spec_ulong("map-cache-size", "Map cache size",
+							   "Bytes of upstream/downstream memory to keep "
+							   "mapped to the DSP between frames (0 to disable); "
+							   "only safe when that memory is recycled",
+							   0, G_MAXULONG, DEFAULT_MAP_CACHE_SIZE,
+							   G_PARAM_READWRITE));
+
+	g_object_class_install_property(gobject_class, ARG_MAP_UNDERSIZED,
+					g_param_spec_boolean("map-undersized", "Map undersized",
+							     "Map input buffers smaller than a full frame "
+							     "directly, when their own allocation is known "
+							     "to cover the rest of the frame, instead of "
+							     "copying them",
+							     DEFAULT_MAP_UNDERSIZED, G_PARAM_READWRITE));
+
+	g_object_class_install_property(gobject_class, ARG_OUTPUT_CPU_ACCESS,
+					g_param_spec_boolean("output-cpu-access", "Output CPU access",
+							     "Whether the CPU reads or writes the output; "
+							     "disable it when it only goes to other hardware "
+							     "(e.g. an overlay) to skip cache maintenance",
+							     DEFAULT_OUTPUT_CPU_ACCESS, G_PARAM_READWRITE));
+
+	g_object_class_install_property(gobject_class, ARG_SHARED_MEMORY,
+					g_param_spec_boolean("shared-memory", "Shared memory",
+							     "Put the message buffers in the node's part "
+							     "of the DSP shared memory segment, so they "
+							     "need no mapping",
+							     DEFAULT_SHARED_MEMORY, G_PARAM_READWRITE));
+
+	g_object_class_install_property(gobject_class, ARG_STATS_INTERVAL,
+					g_param_spec_uint("stats-interval", "Stats interval",
+							  "Milliseconds between 'dsp-memory' element "
+							  "messages with the counters below (0 to disable)",
+							  0, G_MAXUINT, DEFAULT_STATS_INTERVAL,
+							  G_PARAM_READWRITE));
+
+	g_object_class_install_property(gobject_class, ARG_PREWARM_CAPS,
+					g_param_spec_boxed("prewarm-caps", "Prewarm caps",
+							   "Create the DSP node for these caps when "
+							   "going to PAUSED, before any data arrives; "
+							   "it's redone if the stream has other caps",
+							   GST_TYPE_CAPS, G_PARAM_READWRITE));
+
+	g_object_class_install_property(gobject_class, ARG_MIN_BUFFERS,
+					g_param_spec_uint("min-buffers", "Minimum buffers",
+							  "Buffers per port the adaptive count doesn't go under",
+							  1, DU_PORT_MAX_BUFFERS, DEFAULT_MIN_BUFFERS,
+							  G_PARAM_READWRITE));
+
+	g_object_class_install_property(gobject_class, ARG_MAX_BUFFERS,
+					g_param_spec_uint("max-buffers", "Maximum buffers",
+							  "Buffers per port the node is created with, and "
+							  "how far the count adapts to the DSP load "
+							  "(0 keeps the element's fixed counts)",
+							  0, DU_PORT_MAX_BUFFERS, DEFAULT_MAX_BUFFERS,
+							  G_PARAM_READWRITE));
+
+	g_object_class_install_property(gobject_class, ARG_LOW_LATENCY,
+					g_param_spec_boolean("low-latency", "Low latency",
+							     "One buffer in flight per port, for streams "
+							     "without reordering; reports the measured latency",
+							     DEFAULT_LOW_LATENCY, G_PARAM_READWRITE));
+
+	g_object_class_install_property(gobject_class, ARG_TRACE_SIZE,
+					g_param_spec_uint("trace-size", "Trace size",
+							  "Events kept in the trace ring, rounded up to "
+							  "a power of two (0, the default, disables it); "
+							  "takes effect when the DSP is opened",
+							  0, 1 << 20, DEFAULT_TRACE_SIZE,
+							  G_PARAM_READWRITE));
+
+	g_object_class_install_property(gobject_class, ARG_TRACE_FILE,
+					g_param_spec_string("trace-file", "Trace file",
+							    "Dump the trace ring to this file when set; "
+							    "on errors it goes to the temp dir",
+							    NULL, G_PARAM_WRITABLE));
+
+	g_object_class_install_property(gobject_class, ARG_IOCTL_STATS,
+					g_param_spec_boolean("ioctl-stats", "ioctl stats",
+							     "Count and time the DSP ioctls of the whole "
+							     "process, posted as 'dsp-ioctl' messages "
+							     "along with the 'dsp-memory' ones; "
+							     "GST_DSP_IOCTL_STATS also enables it",
+							     DEFAULT_IOCTL_STATS, G_PARAM_READWRITE));
+
+	install_counter(gobject_class, ARG_LIVE_MAPPINGS, "live-mappings",
+			"Buffers currently mapped to the DSP");
+	install_counter(gobject_class, ARG_MAPPED_BYTES, "mapped-bytes",
+			"Bytes currently mapped to the DSP");
+	install_counter(gobject_class, ARG_PEAK_MAPPED_BYTES, "peak-mapped-bytes",
+			"Most bytes mapped to the DSP at once");
+	install_counter(gobject_class, ARG_RESERVED_BYTES, "reserved-bytes",
+			"Bytes of DSP virtual space currently reserved");
+	install_counter(gobject_class, ARG_PEAK_RESERVED_BYTES, "peak-reserved-bytes",
+			"Most bytes of DSP virtual space reserved at once");
+	install_counter(gobject_class, ARG_RESERVE_CALLS, "reserve-calls",
+			"Reservations of DSP virtual space so far");
+	install_counter(gobject_class, ARG_MAP_CALLS, "map-calls",
+			"Mappings to the DSP so far");
+	install_counter(gobject_class, ARG_COPIES, "copies",
+			"Buffers copied because they couldn't be used directly");
 
 	class->sink_event = sink_event;
 	class->src_event = src_event;
@@ -28,9 +28,14 @@ typedef struct _GstDspBaseClass GstDspBaseClass;
 typedef struct du_port_t du_port_t;
 
 #include "dmm_buffer.h"
+#include "dmm_slab.h"
 #include "sem.h"
 #include "async_queue.h"
 
+struct dmm_cache;
+struct trace;
+struct gstdsp_pool;
+
 struct td_buffer;
 
 typedef void (*port_buffer_cb_t) (GstDspBase *base, struct td_buffer *tb);
@@ -44,8 +49,12 @@ struct td_buffer {
 	bool keyframe;
 	bool pinned;
 	bool clean;
+	GstClockTime sent; /* with max-buffers */
 };
 
+/* the queues are rings of this size */
+#define DU_PORT_MAX_BUFFERS 32
+
 struct du_port_t {
 	int id;
 	struct td_buffer *buffers;
@@ -54,6 +63,15 @@ struct du_port_t {
 	port_buffer_cb_t send_cb;
 	port_buffer_cb_t recv_cb;
 	int dir;
+	struct gstdsp_pool *pool;
+
+	/* with max-buffers only 'active' circulate; see port_adapt() */
+	guint active;
+	struct td_buffer *parked[DU_PORT_MAX_BUFFERS];
+	guint num_parked;
+	gint in_dsp;
+	guint replies, starved, min_spare;
+	GstClockTime turnaround; /* average DSP round trip */
 };
 
 struct td_codec {
@@ -71,7 +89,13 @@ struct td_codec {
 struct ts_item {
 	GstClockTime time;
 	GstClockTime duration;
-	GstEvent *event;
+	GSList *events; /* serialized events that came before this buffer */
+	GstClockTime arrival; /* with low-latency */
+};
+
+struct ts_ring {
+	guint mask;
+	struct ts_item items[];
 };
 
 struct _GstDspBase {
@@ -83,29 +107,57 @@ struct _GstDspBase {
 	int dsp_handle;
 	void *proc;
 	struct dsp_node *node;
-	struct dsp_notification *events[3];
+	struct dsp_notification *msg_event;
 
 	GstFlowReturn status;
 	unsigned long input_buffer_size;
 	unsigned long output_buffer_size;
-	GThread *dsp_thread, *out_thread;
+	guint input_headroom; /* staged input room, for codecs that prefix every frame */
+	GThread *out_thread;
 	gboolean done;
 	int deferred_eos;
 	int eos;
 
 	du_port_t *ports[2];
 	dmm_buffer_t *alg_ctrl;
-	struct ts_item ts_array[20];
-	guint ts_in_pos, ts_out_pos, ts_push_pos;
-	GMutex *ts_mutex;
-	gulong ts_count;
+	struct ts_ring *ts_ring;
+	GSList *ts_retired; /* outgrown rings output_loop might still read */
+	GSList *ts_events; /* waiting for the next buffer */
+	guint ts_in_pos, ts_out_pos, ts_push_pos; /* free-running */
+	gboolean ts_events_sent;
+	gint ts_empty; /* outputs without data; their timestamps are left */
 	GstClockTime default_duration;
 	GSem *flush;
+	int draining; /* waiting for every frame to come out, see gstdsp_drain() */
+	GSem *drained;
 	guint alg;
 
 	gboolean use_pad_alloc; /**< Use pad_alloc for output buffers. */
 	gboolean use_pinned; /**< Reuse output buffers. */
+	gboolean use_pool; /**< Recycle output memory through a pre-mapped pool. */
+	gboolean pin_input; /**< Keep input staging memory mapped and reuse it. */
+	gboolean transform_input; /* the codec's send_cb replaces the input data */
 	guint dsp_error;
+	gchar *pending_error; /* to report from the element's own thread */
+	gboolean dispatched; /* the dispatcher waits for its events */
+
+	struct dmm_slab *slab; /* for small control buffers */
+	struct dmm_cache *map_cache;
+	gulong map_cache_size; /* max bytes kept mapped (0 disables the cache) */
+	gboolean map_undersized; /* map short input directly when possible */
+	gboolean output_cpu_access; /* skip output cache maintenance when not */
+	gboolean use_shm; /* comm buffers from the node's CMM memory */
+	struct dmm_stats *stats;
+	guint stats_interval; /* ms between stats messages */
+	GstClockTime stats_last;
+	GstCaps *prewarm_caps; /* create the node with these before any data */
+	GThread *prewarm_thread;
+	GstPadSetCapsFunction sink_setcaps; /* the element's own */
+	guint min_buffers, max_buffers; /* adaptive buffer counts, if max */
+	gboolean low_latency; /* one buffer per port */
+	GstClockTime latency, latency_reported; /* measured, with low_latency */
+	struct trace *trace;
+	guint trace_size;
 
 	void *(*create_node)(GstDspBase *base);
 	bool (*parse_func)(GstDspBase *base, GstBuffer *buf);
@@ -146,6 +198,8 @@ gboolean gstdsp_start(GstDspBase *self);
 gboolean gstdsp_send_codec_data(GstDspBase *self, GstBuffer *buf);
 gboolean gstdsp_set_codec_data_caps(GstDspBase *base, GstBuffer *buf);
 gboolean gstdsp_reinit(GstDspBase *base);
+gboolean gstdsp_drain(GstDspBase *self);
+gboolean gstdsp_reconfigure(GstDspBase *self);
 void gstdsp_got_error(GstDspBase *self, guint id, const char *message);
 void gstdsp_post_error(GstDspBase *self, const char *message);
 void gstdsp_send_alg_ctrl(GstDspBase *self, struct dsp_node *node, dmm_buffer_t *b);
@@ -161,8 +215,7 @@ static inline void gstdsp_port_setup_params(GstDspBase *self,
 	unsigned i;
 	for (i = 0; i < p->num_buffers; i++) {
 		dmm_buffer_t *b;
-		b = dmm_buffer_calloc(self->dsp_handle,
-				      self->proc, size, DMA_BIDIRECTIONAL);
+		b = dmm_slab_calloc(self->slab, size, DMA_BIDIRECTIONAL);
 		if (func)
 			func(self, b);
 		dmm_buffer_map(b);
@@ -8,8 +8,12 @@
  * packaging of this file.
  */
 
+#define LOG_CATEGORY LOG_DMM
+
 #include "gstdspbuffer.h"
 #include "dmm_buffer.h"
+#include "util.h"
+#include "log.h"
 
 typedef struct _GstDspBuffer GstDspBuffer;
 typedef struct _GstDspBufferClass GstDspBufferClass;
@@ -20,12 +24,130 @@ struct _GstDspBuffer {
 	GstBuffer parent;
 	GstDspBase *base;
 	struct td_buffer *tb;
+	struct gstdsp_pool *pool;
+	dmm_buffer_t *data;
 };
 
 struct _GstDspBufferClass {
 	GstBufferClass parent_class;
 };
 
+/*
+ * Pre-allocated and pre-mapped output buffers. When a buffer is pushed, the
+ * GstDspBuffer takes the data away from the td_buffer, which gets a new one
+ * from the pool, and gives it back when finalized. The pool grows when
+ * downstream holds on to buffers, and keeps at most max_free idle ones.
+ *
+ * Buffers might come back long after the element stopped, so the pool keeps
+ * a reference on the handle, which keeps the processor attached too, until
+ * the last of them is freed.
+ */
+struct gstdsp_pool {
+	gint refcount;
+	GMutex *mutex;
+	GSList *free;
+	guint nr_free, max_free;
+	bool active;
+	int handle;
+	void *proc;
+	int dir;
+	size_t size;
+};
+
+struct gstdsp_pool *
+gstdsp_pool_new(GstDspBase *base,
+		int dir,
+		size_t size,
+		guint max_free)
+{
+	struct gstdsp_pool *pool;
+
+	pool = g_slice_new0(struct gstdsp_pool);
+	pool->refcount = 1;
+	pool->mutex = g_mutex_new();
+	pool->max_free = max_free;
+	pool->active = true;
+	pool->handle = base->dsp_handle;
+	pool->proc = base->proc;
+	pool->dir = dir;
+	pool->size = size;
+	gstdsp_handle_ref(pool->handle);
+
+	return pool;
+}
+
+static inline void
+pool_unref(struct gstdsp_pool *pool)
+{
+	if (!g_atomic_int_dec_and_test(&pool->refcount))
+		return;
+	gstdsp_handle_unref(pool->handle);
+	g_mutex_free(pool->mutex);
+	g_slice_free(struct gstdsp_pool, pool);
+}
+
+dmm_buffer_t *
+gstdsp_pool_get(struct gstdsp_pool *pool)
+{
+	dmm_buffer_t *b = NULL;
+
+	g_mutex_lock(pool->mutex);
+	if (pool->free) {
+		b = pool->free->data;
+		pool->free = g_slist_delete_link(pool->free, pool->free);
+		pool->nr_free--;
+	}
+	g_mutex_unlock(pool->mutex);
+
+	if (!b) {
+		pr_debug(NULL, "growing pool %p", pool);
+		b = dmm_buffer_new(pool->handle, pool->proc, pool->dir);
+		dmm_buffer_allocate_frame(b, pool->size);
+		dmm_buffer_map(b);
+	}
+
+	b->len = b->size;
+	return b;
+}
+
+static inline void
+pool_put(struct gstdsp_pool *pool,
+	 dmm_buffer_t *b)
+{
+	g_mutex_lock(pool->mutex);
+	if (pool->active && pool->nr_free < pool->max_free) {
+		pool->free = g_slist_prepend(pool->free, b);
+		pool->nr_free++;
+		b = NULL;
+	}
+	g_mutex_unlock(pool->mutex);
+
+	/* shrink */
+	dmm_buffer_free(b);
+}
+
+void
+gstdsp_pool_destroy(struct gstdsp_pool *pool)
+{
+	GSList *free_list, *l;
+
+	if (!pool)
+		return;
+
+	g_mutex_lock(pool->mutex);
+	pool->active = false;
+	free_list = pool->free;
+	pool->free = NULL;
+	pool->nr_free = 0;
+	g_mutex_unlock(pool->mutex);
+
+	for (l = free_list; l; l = l->next)
+		dmm_buffer_free(l->data);
+	g_slist_free(free_list);
+
+	pool_unref(pool);
+}
+
 static GType type;
 
 GstBuffer *gst_dsp_buffer_new(GstDspBase *base, struct td_buffer *tb)
@@ -42,14 +164,39 @@ GstBuffer *gst_dsp_buffer_new(GstDspBase *base, struct td_buffer *tb)
 	dsp_buf = (GstDspBuffer *) buf;
 	dsp_buf->tb = tb;
 	dsp_buf->base = base;
+	if (tb->port->pool) {
+		dsp_buf->pool = tb->port->pool;
+		dsp_buf->data = b;
+		g_atomic_int_inc(&dsp_buf->pool->refcount);
+	}
 	return buf;
 }
 
+/* the bytes from the data on that are the buffer's own, if it's pooled */
+size_t gst_dsp_buffer_room(GstBuffer *buf)
+{
+	GstDspBuffer *dsp_buf = (GstDspBuffer *) buf;
+	dmm_buffer_t *b;
+	char *data = (char *) GST_BUFFER_DATA(buf), *start;
+
+	if (G_TYPE_FROM_INSTANCE(buf) != type || !dsp_buf->pool)
+		return 0;
+
+	b = dsp_buf->data;
+	start = b->allocated_data;
+	if (!start || data < start || data >= start + b->allocated_size)
+		return 0;
+	return start + b->allocated_size - data;
+}
+
 static void finalize(GstMiniObject *obj)
 {
 	GstDspBuffer *dsp_buf = (GstDspBuffer *) obj;
 	GstDspBase *base = dsp_buf->base;
-	if (dsp_buf->tb->pinned) {
+	if (dsp_buf->pool) {
+		pool_put(dsp_buf->pool, dsp_buf->data);
+		pool_unref(dsp_buf->pool);
+	} else if (dsp_buf->tb->pinned) {
 		if (G_UNLIKELY(g_atomic_int_get(&base->eos)))
 			dsp_buf->tb->clean = true;
 		base->send_buffer(base, dsp_buf->tb);
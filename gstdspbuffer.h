@@ -18,5 +18,10 @@
 GType gst_dsp_buffer_get_type(void);
 
 GstBuffer *gst_dsp_buffer_new(GstDspBase *base, struct td_buffer *tb);
+size_t gst_dsp_buffer_room(GstBuffer *buf);
+
+struct gstdsp_pool *gstdsp_pool_new(GstDspBase *base, int dir, size_t size, guint max_free);
+void gstdsp_pool_destroy(struct gstdsp_pool *pool);
+dmm_buffer_t *gstdsp_pool_get(struct gstdsp_pool *pool);
 
 #endif /* GST_DSP_BASE_H */
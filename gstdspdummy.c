@@ -94,18 +94,13 @@ dsp_init(GstDspDummy *self)
 {
 	int dsp_handle;
 
-	self->dsp_handle = dsp_handle = dsp_open();
+	self->dsp_handle = dsp_handle = gstdsp_open(&self->proc);
 
 	if (dsp_handle < 0) {
 		pr_err(self, "dsp open failed");
 		return FALSE;
 	}
 
-	if (!dsp_attach(dsp_handle, 0, NULL, &self->proc)) {
-		pr_err(self, "dsp attach failed");
-		goto fail;
-	}
-
 	self->node = create_node(self);
 	if (!self->node) {
 		pr_err(self, "dsp node creation failed");
@@ -115,17 +110,10 @@ dsp_init(GstDspDummy *self)
 	return TRUE;
 
 fail:
-	if (self->proc) {
-		if (!dsp_detach(dsp_handle, self->proc))
-			pr_err(self, "dsp detach failed");
-		self->proc = NULL;
-	}
-
-	if (self->dsp_handle >= 0) {
-		if (dsp_close(dsp_handle) < 0)
-			pr_err(self, "dsp close failed");
-		self->dsp_handle = -1;
-	}
+	if (!gstdsp_close(dsp_handle, false))
+		pr_err(self, "dsp close failed");
+	self->dsp_handle = -1;
+	self->proc = NULL;
 
 	return FALSE;
 }
@@ -135,26 +123,14 @@ dsp_deinit(GstDspDummy *self)
 {
 	gboolean ret = TRUE;
 
-	if (self->dsp_error)
-		goto leave;
-
-	if (self->proc) {
-		if (!dsp_detach(self->dsp_handle, self->proc)) {
-			pr_err(self, "dsp detach failed");
-			ret = FALSE;
-		}
-		self->proc = NULL;
-	}
-
-leave:
-
 	if (self->dsp_handle >= 0) {
-		if (dsp_close(self->dsp_handle) < 0) {
+		if (!gstdsp_close(self->dsp_handle, self->dsp_error)) {
 			pr_err(self, "dsp close failed");
 			ret = FALSE;
 		}
 		self->dsp_handle = -1;
 	}
+	self->proc = NULL;
 
 	return ret;
 }
@@ -137,7 +137,7 @@ gst_dsp_ipp_get_noise_filter_type(void)
 static inline dmm_buffer_t *ipp_calloc(GstDspIpp *self, size_t size, int dir)
 {
 	GstDspBase *base = GST_DSP_BASE(self);
-	return dmm_buffer_calloc(base->dsp_handle, base->proc, size, dir);
+	return dmm_slab_calloc(base->slab, size, dir);
 }
 
 /* star algo */
@@ -498,9 +498,13 @@ static void got_message(GstDspBase *base, struct dsp_msg *msg)
 	}
 
 	switch (command_id) {
+	case DFGM_DESTROY_XBF_ACK:
+		/* last one of send_stop_message(); don't wait for another event */
+		free_message_args(self);
+		base->done = TRUE;
+		break;
 	case DFGM_CREATE_XBF_ACK:
 	case DFGM_CREATE_XBF_PIPE_ACK:
-	case DFGM_DESTROY_XBF_ACK:
 	case DFGM_SET_XBF_ALGS_ACK:
 	case DFGM_STOP_PROCESSING_ACK:
 	case DFGM_CLEAR_XBF_ALGS_ACK:
@@ -1559,6 +1563,9 @@ static void instance_init(GTypeInstance *instance, gpointer g_class)
 	base->reset = reset;
 	self->msg_sem = g_sem_new(1);
 	base->eos_timeout = 0;
+	/* the input buffer might be pushed as output */
+	base->use_pool = FALSE;
+	base->pin_input = FALSE;
 
 	/* initialize params to normal strength */
 	memcpy(&self->eenf_params, &eenf_normal, sizeof(eenf_normal));
@@ -12,6 +12,8 @@
  * packaging of this file.
  */
 
+#define LOG_CATEGORY LOG_CODEC
+
 #include <gst/gst.h>
 #include "gstdspbase.h"
 #include "gstdspvdec.h"
@@ -177,6 +177,9 @@ create_node(GstDspBase *base)
 		if (!arg_data)
 			return NULL;
 
+		self->node_width = self->width;
+		self->node_height = self->height;
+
 		if (!dsp_node_allocate(dsp_handle, base->proc, codec->uuid, arg_data, &attrs, &node)) {
 			pr_err(self, "dsp node allocate failed");
 			free(arg_data);
@@ -330,6 +333,33 @@ static inline gboolean need_node_reset(GstDspVDec *self, GstCaps *new_caps)
 	return TRUE;
 }
 
+/* a smaller frame size only needs a drain */
+static inline gboolean can_keep_node(GstDspVDec *self, GstCaps *new_caps)
+{
+	gint width = 0, height = 0;
+	GstStructure *struc, *old_struc;
+	GstDspBase *base = GST_DSP_BASE(self);
+	GstCaps *old_caps;
+
+	old_caps = GST_PAD_CAPS(base->sinkpad);
+	if (!old_caps)
+		return FALSE;
+
+	struc = gst_caps_get_structure(new_caps, 0);
+	old_struc = gst_caps_get_structure(old_caps, 0);
+	if (!gst_structure_has_name(struc, gst_structure_get_name(old_struc)))
+		return FALSE;
+
+	gst_structure_get_int(struc, "width", &width);
+	gst_structure_get_int(struc, "height", &height);
+
+	if (ROUND_UP(width, 16) > self->node_width ||
+	    ROUND_UP(height, 16) > self->node_height)
+		return FALSE;
+
+	return TRUE;
+}
+
 static gboolean
 sink_setcaps(GstPad *pad,
 	     GstCaps *caps)
@@ -340,6 +370,7 @@ sink_setcaps(GstPad *pad,
 	GstCaps *out_caps;
 	const char *name;
 	gboolean ret;
+	gboolean keep_node = FALSE;
 	struct td_codec *codec;
 
 	self = GST_DSP_VDEC(GST_PAD_PARENT(pad));
@@ -353,8 +384,12 @@ sink_setcaps(GstPad *pad,
 	}
 #endif
 
-	if (need_node_reset(self, caps))
-		gstdsp_reinit(base);
+	if (need_node_reset(self, caps)) {
+		if (can_keep_node(self, caps) && gstdsp_drain(base))
+			keep_node = TRUE;
+		else
+			gstdsp_reinit(base);
+	}
 
 	in_struc = gst_caps_get_structure(caps, 0);
 
@@ -438,6 +473,10 @@ skip_setup:
 		return FALSE;
 
 	save_codec_data(base, in_struc);
+
+	if (keep_node)
+		return gstdsp_reconfigure(base);
+
 	return TRUE;
 }
 
@@ -46,6 +46,7 @@ struct _GstDspVDec {
 	GstDspBase element;
 	gint width, height;
 	gint crop_width, crop_height;
+	gint node_width, node_height; /* what the node was created for */
 	gint frame_index;
 	gboolean wmv_is_vc1;
 	gboolean jpeg_is_interlaced;
@@ -54,7 +54,23 @@ log_level_to_gst(unsigned int level)
 }
 #endif
 
-void pr_helper(unsigned int level,
+#ifndef GST_DISABLE_GST_DEBUG
+GstDebugCategory *pr_categories[LOG_CATEGORIES];
+#endif
+
+/* after gstdsp_debug */
+void pr_init(void)
+{
+#ifndef GST_DISABLE_GST_DEBUG
+	pr_categories[LOG_BASE] = gstdsp_debug;
+	pr_categories[LOG_BRIDGE] = _gst_debug_category_new("dspbridge", 0, "DSP bridge");
+	pr_categories[LOG_DMM] = _gst_debug_category_new("dspdmm", 0, "DSP memory");
+	pr_categories[LOG_CODEC] = _gst_debug_category_new("dspcodec", 0, "DSP codecs");
+#endif
+}
+
+void pr_helper(unsigned int category,
+		unsigned int level,
 		void *object,
 		const char *file,
 		const char *function,
@@ -62,43 +78,52 @@ void pr_helper(unsigned int level,
 		const char *fmt,
 		...)
 {
-	char *tmp;
+	char *tmp = NULL;
 	va_list args;
+	bool print = level <= 2;
 
-	va_start(args, fmt);
+#if defined(DEVEL) || defined(DEBUG)
+	if (level == 3)
+		print = true;
+#endif
+#ifdef DEBUG
+	if (level == 4)
+		print = true;
+#endif
 
-	if (vasprintf(&tmp, fmt, args) < 0)
-		goto leave;
+	if (print) {
+		va_start(args, fmt);
+		if (vasprintf(&tmp, fmt, args) < 0)
+			tmp = NULL;
+		va_end(args);
+	}
 
-	if (level <= 1) {
+	if (print && tmp) {
+		if (level <= 1) {
 #ifdef SYSLOG
-		if (object && GST_IS_OBJECT(object) && GST_OBJECT_NAME(object))
-			syslog(log_level_to_syslog(level), "%s: %s", GST_OBJECT_NAME(object), tmp);
-		else
-			syslog(log_level_to_syslog(level), "%s", tmp);
+			if (object && GST_IS_OBJECT(object) && GST_OBJECT_NAME(object))
+				syslog(log_level_to_syslog(level), "%s: %s", GST_OBJECT_NAME(object), tmp);
+			else
+				syslog(log_level_to_syslog(level), "%s", tmp);
 #endif
-		if (level == 0)
-			g_printerr("%s: %s\n", function, tmp);
+			if (level == 0)
+				g_printerr("%s: %s\n", function, tmp);
+			else
+				g_print("%s: %s\n", function, tmp);
+		}
+		else if (level == 2 || level == 4)
+			g_print("%s:%s(%u): %s\n", file, function, line, tmp);
 		else
 			g_print("%s: %s\n", function, tmp);
+		free(tmp);
 	}
-	else if (level == 2)
-		g_print("%s:%s(%u): %s\n", file, function, line, tmp);
-#if defined(DEVEL) || defined(DEBUG)
-	else if (level == 3)
-		g_print("%s: %s\n", function, tmp);
-#endif
-#ifdef DEBUG
-	else if (level == 4)
-		g_print("%s:%s(%u): %s\n", file, function, line, tmp);
-#endif
 
 #ifndef GST_DISABLE_GST_DEBUG
-	gst_debug_log_valist(gstdsp_debug, log_level_to_gst(level), file, function, line, object, fmt, args);
+	if (pr_categories[category]) {
+		va_start(args, fmt);
+		gst_debug_log_valist(pr_categories[category], log_level_to_gst(level),
+				     file, function, line, object, fmt, args);
+		va_end(args);
+	}
 #endif
-
-	free(tmp);
-
-leave:
-	va_end(args);
 }
@@ -11,28 +11,84 @@
 #ifndef LOG_H
 #define LOG_H
 
+#include <gst/gst.h>
+#include <stdbool.h>
+
 /* #define DEBUG */
 
-void pr_helper(unsigned int level,
+/* GStreamer debug categories: dsp, dspbridge, dspdmm, dspcodec */
+enum {
+	LOG_BASE,
+	LOG_BRIDGE,
+	LOG_DMM,
+	LOG_CODEC,
+	LOG_CATEGORIES,
+};
+
+/* files of other subsystems define it before any include */
+#ifndef LOG_CATEGORY
+#define LOG_CATEGORY LOG_BASE
+#endif
+
+void pr_init(void);
+
+void pr_helper(unsigned int category,
+		unsigned int level,
 		void *object,
 		const char *file,
 		const char *function,
 		unsigned int line,
 		const char *fmt,
-		...) __attribute__((format(printf, 6, 7)));
+		...) __attribute__((format(printf, 7, 8)));
+
+#ifndef GST_DISABLE_GST_DEBUG
+extern GstDebugCategory *pr_categories[LOG_CATEGORIES];
+#endif
+
+/* whether anything would come out; nothing gets formatted otherwise */
+static inline bool
+pr_enabled(unsigned int category,
+		unsigned int level)
+{
+	if (level <= 2)
+		return true;
+#if defined(DEBUG)
+	return true;
+#else
+#if defined(DEVEL)
+	if (level == 3)
+		return true;
+#endif
+#ifndef GST_DISABLE_GST_DEBUG
+	{
+		GstDebugLevel gst_level = level == 3 ? GST_LEVEL_INFO : GST_LEVEL_DEBUG;
+
+		if (G_LIKELY(gst_level > __gst_debug_min) || !pr_categories[category])
+			return false;
+		return gst_level <= gst_debug_category_get_threshold(pr_categories[category]);
+	}
+#else
+	return false;
+#endif
+#endif
+}
 
-#define pr_base(level, object, ...) pr_helper(level, object, __FILE__, __func__, __LINE__, __VA_ARGS__)
+#define pr_base(category, level, object, ...) \
+	({ if (pr_enabled(category, level)) \
+		pr_helper(category, level, object, __FILE__, __func__, __LINE__, __VA_ARGS__); })
 
-#define pr_err(object, ...) pr_base(0, object, __VA_ARGS__)
-#define pr_warning(object, ...) pr_base(1, object, __VA_ARGS__)
-#define pr_test(object, ...) pr_base(2, object, __VA_ARGS__)
+#define pr_err(object, ...) pr_base(LOG_CATEGORY, 0, object, __VA_ARGS__)
+#define pr_warning(object, ...) pr_base(LOG_CATEGORY, 1, object, __VA_ARGS__)
+#define pr_test(object, ...) pr_base(LOG_CATEGORY, 2, object, __VA_ARGS__)
 
 #if !defined(GST_DISABLE_GST_DEBUG) || defined(DEBUG)
-#define pr_info(object, ...) pr_base(3, object, __VA_ARGS__)
-#define pr_debug(object, ...) pr_base(4, object, __VA_ARGS__)
+#define pr_info(object, ...) pr_base(LOG_CATEGORY, 3, object, __VA_ARGS__)
+#define pr_debug(object, ...) pr_base(LOG_CATEGORY, 4, object, __VA_ARGS__)
+#define pr_cat_debug(category, object, ...) pr_base(category, 4, object, __VA_ARGS__)
 #else
-#define pr_info(object, ...) ({ if (0) pr_base(3, object, __VA_ARGS__); })
-#define pr_debug(object, ...) ({ if (0) pr_base(4, object, __VA_ARGS__); })
+#define pr_info(object, ...) ({ if (0) pr_base(LOG_CATEGORY, 3, object, __VA_ARGS__); })
+#define pr_debug(object, ...) ({ if (0) pr_base(LOG_CATEGORY, 4, object, __VA_ARGS__); })
+#define pr_cat_debug(category, object, ...) ({ if (0) pr_base(category, 4, object, __VA_ARGS__); })
 #endif
 
 #endif /* LOG_H */
@@ -158,6 +158,7 @@ int main(int argc, char *argv[])
 #ifndef GST_DISABLE_GST_DEBUG
 	gstdsp_debug = _gst_debug_category_new("dsp", 0, "DSP stuff");
 #endif
+	pr_init();
 
 	dec = g_object_new(GST_DSP_VDEC_TYPE, NULL);
 
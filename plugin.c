@@ -28,6 +28,7 @@ plugin_init(GstPlugin *plugin)
 #ifndef GST_DISABLE_GST_DEBUG
 	gstdsp_debug = _gst_debug_category_new("dsp", 0, "DSP stuff");
 #endif
+	pr_init();
 
 	if (!gst_element_register(plugin, "dspdummy", GST_RANK_NONE, GST_DSP_DUMMY_TYPE))
 		return FALSE;
@@ -0,0 +1,212 @@
+/*
+ * Copyright (C) 2011 Felipe Contreras
+ *
+ * Author: Felipe Contreras <felipe.contreras@gmail.com>
+ *
+ * This file may be used under the terms of the GNU Lesser General Public
+ * License version 2.1, a copy of which is found in LICENSE included in the
+ * packaging of this file.
+ */
+
+/*
+ * AsyncQueue against the GList queue it replaced. The hand-off latency has
+ * two threads bounce a buffer back and forth through a pair of queues, like
+ * pad_chain and dsp_thread do; the push/pop cost is without contention.
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "async_queue.h"
+
+#define ROUNDS 100000
+
+struct list_queue {
+	GMutex *mutex;
+	GCond *condition;
+	GList *head;
+	GList *tail;
+};
+
+static struct list_queue *
+list_queue_new(void)
+{
+	struct list_queue *queue;
+
+	queue = g_slice_new0(struct list_queue);
+	queue->condition = g_cond_new();
+	queue->mutex = g_mutex_new();
+
+	return queue;
+}
+
+static void
+list_queue_free(struct list_queue *queue)
+{
+	g_cond_free(queue->condition);
+	g_mutex_free(queue->mutex);
+	g_list_free(queue->head);
+	g_slice_free(struct list_queue, queue);
+}
+
+static void
+list_queue_push(struct list_queue *queue,
+		gpointer data)
+{
+	g_mutex_lock(queue->mutex);
+	queue->head = g_list_prepend(queue->head, data);
+	if (!queue->tail)
+		queue->tail = queue->head;
+	g_cond_signal(queue->condition);
+	g_mutex_unlock(queue->mutex);
+}
+
+static gpointer
+list_queue_pop(struct list_queue *queue)
+{
+	gpointer data = NULL;
+
+	g_mutex_lock(queue->mutex);
+	while (!queue->tail)
+		g_cond_wait(queue->condition, queue->mutex);
+
+	data = queue->tail->data;
+	queue->tail = queue->tail->prev;
+	if (queue->tail) {
+		g_list_free_1(queue->tail->next);
+		queue->tail->next = NULL;
+	} else {
+		g_list_free_1(queue->head);
+		queue->head = NULL;
+	}
+	g_mutex_unlock(queue->mutex);
+
+	return data;
+}
+
+struct pair {
+	void *ping, *pong;
+	void (*push)(void *queue, gpointer data);
+	gpointer (*pop)(void *queue);
+};
+
+static void
+ring_push(void *queue,
+	  gpointer data)
+{
+	async_queue_push(queue, data);
+}
+
+static gpointer
+ring_pop(void *queue)
+{
+	gpointer data;
+
+	/* pop gives up after one wake-up; so does pad_chain */
+	while (!(data = async_queue_pop(queue)));
+	return data;
+}
+
+static void
+list_push(void *queue,
+	  gpointer data)
+{
+	list_queue_push(queue, data);
+}
+
+static gpointer
+list_pop(void *queue)
+{
+	return list_queue_pop(queue);
+}
+
+static gpointer
+echo(gpointer data)
+{
+	struct pair *pair = data;
+	unsigned i;
+
+	for (i = 0; i < ROUNDS; i++)
+		pair->push(pair->pong, pair->pop(pair->ping));
+
+	return NULL;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* nanoseconds per hand-off */
+static double
+run(struct pair *pair)
+{
+	GThread *thread;
+	double start;
+	unsigned i;
+	int token;
+
+	thread = g_thread_create(echo, pair, TRUE, NULL);
+
+	start = now();
+	for (i = 0; i < ROUNDS; i++) {
+		pair->push(pair->ping, &token);
+		pair->pop(pair->pong);
+	}
+
+	g_thread_join(thread);
+
+	return (now() - start) / (ROUNDS * 2);
+}
+
+/* nanoseconds per push and pop */
+static double
+run_uncontended(struct pair *pair)
+{
+	double start;
+	unsigned i;
+	int token;
+
+	start = now();
+	for (i = 0; i < ROUNDS; i++) {
+		pair->push(pair->ping, &token);
+		pair->pop(pair->ping);
+	}
+
+	return (now() - start) / ROUNDS;
+}
+
+int
+main(void)
+{
+	struct pair pair;
+
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
+	pair.ping = list_queue_new();
+	pair.pong = list_queue_new();
+	pair.push = list_push;
+	pair.pop = list_pop;
+	printf("queue-handoff-list %.0f ns\n", run(&pair));
+	printf("queue-pushpop-list %.0f ns\n", run_uncontended(&pair));
+	list_queue_free(pair.ping);
+	list_queue_free(pair.pong);
+
+	pair.ping = async_queue_new(4);
+	pair.pong = async_queue_new(4);
+	pair.push = ring_push;
+	pair.pop = ring_pop;
+	printf("queue-handoff-ring %.0f ns\n", run(&pair));
+	printf("queue-pushpop-ring %.0f ns\n", run_uncontended(&pair));
+	async_queue_free(pair.ping);
+	async_queue_free(pair.pong);
+
+	return 0;
+}
@@ -11,6 +11,8 @@
  * packaging of this file.
  */
 
+#define LOG_CATEGORY LOG_CODEC
+
 #include "dsp_bridge.h"
 #include "dmm_buffer.h"
 
@@ -186,6 +188,8 @@ static GstBuffer *transform_codec_data(GstDspVDec *self, GstBuffer *buf)
 
 	pr_debug(self, "lol: %d", lol);
 	self->priv.h264.lol = lol;
+	/* the frames get copied to make room for the start codes */
+	GST_DSP_BASE(self)->transform_input = lol < 3;
 
 	return new;
 
@@ -227,18 +231,30 @@ static void transform_nal_encoding(GstDspVDec *self, struct td_buffer *tb)
 	}
 
 	if (lol < 3) {
-		/* slower, but unlikely path; need to copy stuff to make room for sync */
-		guint8 *odata, *alloc_data;
+		/* need to copy stuff to make room for sync */
+		dmm_buffer_t old = { .allocated_data = NULL };
+		guint8 *odata;
 		gint osize;
 
 		/* set up for next run */
 		data = b->data;
 		size = b->len;
 		osize = size + nal * (4 - lol);
-		/* save this so it is not free'd by subsequent allocate */
-		alloc_data = b->allocated_data;
-		b->allocated_data = NULL;
-		dmm_buffer_allocate(b, osize);
+		if (b->allocated_data && !b->frame && b->allocated_size >= (size_t) osize &&
+		    !dmm_buffer_headroom(b) && b->data != b->allocated_data) {
+			/* the copy of a previous frame is big enough */
+			b->data = b->allocated_data;
+			b->len = b->size = osize;
+			dmm_buffer_dirty_all(b);
+		} else {
+			/* keep this until copied; the allocation would release it */
+			old.allocated_data = b->allocated_data;
+			old.allocated_size = b->allocated_size;
+			old.frame = b->frame;
+			b->allocated_data = NULL;
+			b->frame = false;
+			dmm_buffer_allocate(b, osize);
+		}
 
 		odata = b->data;
 		while (size) {
@@ -261,7 +277,7 @@ static void transform_nal_encoding(GstDspVDec *self, struct td_buffer *tb)
 			gst_buffer_unref(tb->user_data);
 			tb->user_data = NULL;
 		}
-		free(alloc_data);
+		dmm_buffer_release_data(&old);
 	}
 	return;
 
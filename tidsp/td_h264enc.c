@@ -11,6 +11,8 @@
  * packaging of this file.
  */
 
+#define LOG_CATEGORY LOG_CODEC
+
 #include "dsp_bridge.h"
 #include "dmm_buffer.h"
 
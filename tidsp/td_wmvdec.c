@@ -11,6 +11,8 @@
  * packaging of this file.
  */
 
+#define LOG_CATEGORY LOG_CODEC
+
 #include "dsp_bridge.h"
 #include "dmm_buffer.h"
 
@@ -139,16 +141,30 @@ static inline void send_rcv_buffer(GstDspBase *base, GstBuffer *buf)
 
 static inline void prefix_vc1(GstDspVDec *self, struct td_buffer *tb)
 {
-	guint8 *input_data, *output_data, *alloc_data;
+	guint8 *input_data, *output_data;
 	gint input_size, output_size;
 	dmm_buffer_t *b = tb->data;
+	dmm_buffer_t old = { .allocated_data = NULL };
+
+	if (G_LIKELY(self->codec_data_sent) && dmm_buffer_headroom(b) >= 4) {
+		/* prefix buffer with 0x0000010d, in place */
+		b->data = (guint8 *) b->data - 4;
+		b->len += 4;
+		b->size += 4;
+		GST_WRITE_UINT32_BE(b->data, 0x10d);
+		dmm_buffer_dirty(b, 0, 4);
+		return;
+	}
 
 	input_data = b->data;
 	input_size = b->len;
 
-	/* save this so it is not freed by subsequent allocate */
-	alloc_data = b->allocated_data;
+	/* keep this until copied; the allocation would release it */
+	old.allocated_data = b->allocated_data;
+	old.allocated_size = b->allocated_size;
+	old.frame = b->frame;
 	b->allocated_data = NULL;
+	b->frame = false;
 
 	if (G_LIKELY(self->codec_data_sent)) {
 		output_size = input_size + 4;
@@ -187,7 +203,7 @@ static inline void prefix_vc1(GstDspVDec *self, struct td_buffer *tb)
 		gst_buffer_unref(tb->user_data);
 		tb->user_data = NULL;
 	}
-	g_free(alloc_data);
+	dmm_buffer_release_data(&old);
 	return;
 }
 
@@ -199,8 +215,12 @@ static void in_send_cb(GstDspBase *base, struct td_buffer *tb)
 	uint32_t vc1_startcode = *(uint32_t *)tb->data->data;
 
 	if ((vc1_startcode & 0x00FFFFFF) == 0x010000 && (vc1_startcode >> 24 >= 0x0A)
-			&& (vc1_startcode >> 24 <= 0x1F))
+			&& (vc1_startcode >> 24 <= 0x1F)) {
 		self->codec_data_sent = TRUE;
+		/* the stream has its own start codes; no need to stage it */
+		base->input_headroom = 0;
+		base->transform_input = FALSE;
+	}
 	else if (self->wmv_is_vc1)
 		prefix_vc1(self, tb);
 
@@ -237,6 +257,12 @@ static void setup_params(GstDspBase *base)
 	gstdsp_port_setup_params(base, p, sizeof(*in_param), NULL);
 	p->send_cb = in_send_cb;
 
+	if (self->wmv_is_vc1) {
+		base->input_headroom = 4;
+		/* without the room, prefix_vc1() copies the frame */
+		base->transform_input = TRUE;
+	}
+
 	p = base->ports[1];
 	gstdsp_port_setup_params(base, p, sizeof(*out_param), NULL);
 	p->recv_cb = out_recv_cb;
@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2011 Felipe Contreras
+ *
+ * Author: Felipe Contreras <felipe.contreras@gmail.com>
+ *
+ * This file may be used under the terms of the GNU Lesser General Public
+ * License version 2.1, a copy of which is found in LICENSE included in the
+ * packaging of this file.
+ */
+
+/*
+ * Prints a dump of the trace ring: one event per line, with the time since
+ * the first event and since the previous one, in microseconds.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "trace.h"
+
+static const char *
+type_name(unsigned type)
+{
+	switch (type) {
+	case TRACE_CHAIN: return "chain";
+	case TRACE_SEND: return "send";
+	case TRACE_REPLY: return "reply";
+	case TRACE_PUSH: return "push";
+	case TRACE_QUEUE: return "queue";
+	case TRACE_IOCTL: return "ioctl";
+	case TRACE_ERROR: return "error";
+	default: return "unknown";
+	}
+}
+
+static void
+print_event(const struct trace_event *e,
+	    uint64_t first,
+	    uint64_t prev)
+{
+	printf("%12.3f %+10.3f %-6s ",
+	       (e->time - first) / 1000.0, (e->time - prev) / 1000.0,
+	       type_name(e->type));
+
+	switch (e->type) {
+	case TRACE_CHAIN:
+		printf("size=%u\n", e->arg_2);
+		break;
+	case TRACE_SEND:
+	case TRACE_REPLY:
+		printf("%s len=%u\n", e->arg_1 == 0 ? "input" : "output", e->arg_2);
+		break;
+	case TRACE_PUSH:
+		printf("len=%u\n", e->arg_2);
+		break;
+	case TRACE_QUEUE:
+		printf("%s waiting=%u\n", e->arg_1 == 0 ? "input" : "output", e->arg_2);
+		break;
+	case TRACE_IOCTL:
+		printf("msg=0x%04x %.3f us\n", e->arg_1, e->arg_2 / 1000.0);
+		break;
+	case TRACE_ERROR:
+		printf("id=0x%04x errno=%u\n", e->arg_1, e->arg_2);
+		break;
+	default:
+		printf("type=%u arg_1=%u arg_2=%u\n", e->type, e->arg_1, e->arg_2);
+		break;
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct trace_header header;
+	struct trace_event e;
+	uint64_t first = 0, prev = 0;
+	unsigned i;
+	FILE *f;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <dump>\n", argv[0]);
+		return 1;
+	}
+
+	f = fopen(argv[1], "rb");
+	if (!f) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	if (fread(&header, sizeof(header), 1, f) != 1 ||
+	    memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0)
+	{
+		fprintf(stderr, "%s: not a trace dump\n", argv[1]);
+		fclose(f);
+		return 1;
+	}
+
+	if (header.version != TRACE_VERSION) {
+		fprintf(stderr, "%s: unknown version %u\n", argv[1], header.version);
+		fclose(f);
+		return 1;
+	}
+
+	printf("%u events, %u lost\n", header.count, header.lost);
+
+	for (i = 0; i < header.count; i++) {
+		if (fread(&e, sizeof(e), 1, f) != 1) {
+			fprintf(stderr, "%s: truncated\n", argv[1]);
+			break;
+		}
+		if (i == 0)
+			first = prev = e.time;
+		print_event(&e, first, prev);
+		prev = e.time;
+	}
+
+	fclose(f);
+
+	return 0;
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2011 Felipe Contreras
+ *
+ * Author: Felipe Contreras <felipe.contreras@gmail.com>
+ *
+ * This file may be used under the terms of the GNU Lesser General Public
+ * License version 2.1, a copy of which is found in LICENSE included in the
+ * packaging of this file.
+ */
+
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct trace *
+trace_new(unsigned size)
+{
+	struct trace *trace;
+	unsigned n = 2;
+
+	while (n < size)
+		n <<= 1;
+
+	trace = calloc(1, sizeof(*trace) + n * sizeof(trace->events[0]));
+	if (!trace)
+		return NULL;
+
+	trace->mask = n - 1;
+
+	return trace;
+}
+
+void
+trace_free(struct trace *trace)
+{
+	free(trace);
+}
+
+/* events still being recorded might come out torn; good enough */
+bool
+trace_dump(struct trace *trace,
+	   const char *filename)
+{
+	struct trace_header header;
+	unsigned pos, start, i;
+	FILE *f;
+	bool ret = true;
+
+	if (!trace)
+		return false;
+
+	f = fopen(filename, "wb");
+	if (!f)
+		return false;
+
+	pos = *(volatile unsigned *) &trace->pos;
+	start = pos > trace->mask + 1 ? pos - (trace->mask + 1) : 0;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.version = TRACE_VERSION;
+	header.count = pos - start;
+	header.lost = start;
+
+	if (fwrite(&header, sizeof(header), 1, f) != 1)
+		ret = false;
+
+	for (i = start; ret && i != pos; i++)
+		if (fwrite(&trace->events[i & trace->mask], sizeof(struct trace_event), 1, f) != 1)
+			ret = false;
+
+	if (fclose(f) != 0)
+		ret = false;
+
+	return ret;
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2011 Felipe Contreras
+ *
+ * Author: Felipe Contreras <felipe.contreras@gmail.com>
+ *
+ * This file may be used under the terms of the GNU Lesser General Public
+ * License version 2.1, a copy of which is found in LICENSE included in the
+ * packaging of this file.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Binary per-buffer events, so glitches can be looked at without the
+ * timing changes of text logs. Recording is an atomic increment, a clock
+ * read, and a 16 byte store; any thread can do it. The oldest events get
+ * overwritten. Dumps are read by gst-dsp-trace.
+ */
+
+enum trace_type {
+	TRACE_CHAIN = 1, /* arg_2: size */
+	TRACE_SEND, /* arg_1: port, arg_2: len */
+	TRACE_REPLY, /* arg_1: port, arg_2: len */
+	TRACE_PUSH, /* arg_2: len */
+	TRACE_QUEUE, /* arg_1: port, arg_2: buffers waiting */
+	TRACE_IOCTL, /* arg_1: message, arg_2: ns */
+	TRACE_ERROR, /* arg_1: error id or message, arg_2: errno */
+};
+
+struct trace_event {
+	uint64_t time; /* ns, monotonic */
+	uint16_t type;
+	uint16_t arg_1;
+	uint32_t arg_2;
+};
+
+#define TRACE_MAGIC "GSTDSPTR"
+#define TRACE_VERSION 1
+
+/* the file: this, then count events, oldest first */
+struct trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t count;
+	uint32_t lost; /* overwritten before the dump */
+	uint32_t reserved;
+};
+
+struct trace {
+	unsigned mask;
+	unsigned pos; /* free-running */
+	struct trace_event events[];
+};
+
+struct trace *trace_new(unsigned size);
+void trace_free(struct trace *trace);
+bool trace_dump(struct trace *trace, const char *filename);
+
+static inline uint64_t
+trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void
+trace_add_at(struct trace *trace,
+		uint64_t time,
+		unsigned type,
+		unsigned arg_1,
+		uint32_t arg_2)
+{
+	struct trace_event *e;
+
+	if (!trace)
+		return;
+
+	e = &trace->events[__sync_fetch_and_add(&trace->pos, 1) & trace->mask];
+	e->time = time;
+	e->type = type;
+	e->arg_1 = arg_1;
+	e->arg_2 = arg_2;
+}
+
+static inline void
+trace_add(struct trace *trace,
+		unsigned type,
+		unsigned arg_1,
+		uint32_t arg_2)
+{
+	if (trace)
+		trace_add_at(trace, trace_now(), type, arg_1, arg_2);
+}
+
+#endif /* TRACE_H */
@@ -8,25 +8,199 @@
  * packaging of this file.
  */
 
+#define LOG_CATEGORY LOG_BRIDGE
+
 #include "util.h"
 
 #include <glib.h>
 #include <gst/gst.h>
 
+#include <unistd.h> /* for dup, close */
+#include <string.h> /* for memcmp, strcmp */
+
+/*
+ * All the elements share one bridge handle and processor attachment; each
+ * one gets its own dup() of the handle, so buffers and their counters can
+ * still tell them apart. Whatever keeps using an element's handle after the
+ * element is done with it (e.g. pooled buffers still downstream) takes a
+ * reference, so the number isn't closed, and reused, under it. The
+ * attachment goes away with the last handle.
+ */
+
+static struct {
+	int handle;
+	void *proc;
+	unsigned refcount; /* dup()s open */
+	bool error;
+	GHashTable *refs; /* dup() -> references */
+} shared = { .handle = -1 };
+
+G_LOCK_DEFINE_STATIC(shared);
+
+int gstdsp_open(void **proc)
+{
+	int handle = -1;
+
+	G_LOCK(shared);
+
+	if (!shared.refs)
+		shared.refs = g_hash_table_new(NULL, NULL);
+
+	if (shared.handle < 0) {
+		shared.handle = dsp_open();
+		if (shared.handle < 0)
+			goto leave;
+		if (!dsp_attach(shared.handle, 0, NULL, &shared.proc)) {
+			pr_err(NULL, "dsp attach failed");
+			dsp_close(shared.handle);
+			shared.handle = -1;
+			goto leave;
+		}
+		shared.error = false;
+	}
+
+	handle = dup(shared.handle);
+	if (handle >= 0) {
+		shared.refcount++;
+		g_hash_table_insert(shared.refs, GINT_TO_POINTER(handle), GUINT_TO_POINTER(1));
+		*proc = shared.proc;
+	}
+	else if (shared.refcount == 0) {
+		dsp_detach(shared.handle, shared.proc);
+		dsp_close(shared.handle);
+		shared.handle = -1;
+	}
+
+leave:
+	G_UNLOCK(shared);
+	return handle;
+}
+
+/* after a DSP error, don't bother detaching; closing cleans up */
+static inline bool
+handle_unref(int handle)
+{
+	guint refs;
+	bool ret = true;
+
+	refs = GPOINTER_TO_UINT(g_hash_table_lookup(shared.refs, GINT_TO_POINTER(handle)));
+	if (refs > 1) {
+		g_hash_table_insert(shared.refs, GINT_TO_POINTER(handle), GUINT_TO_POINTER(refs - 1));
+		return true;
+	}
+	g_hash_table_remove(shared.refs, GINT_TO_POINTER(handle));
+
+	if (close(handle) < 0)
+		ret = false;
+
+	if (--shared.refcount == 0) {
+		if (!shared.error && !dsp_detach(shared.handle, shared.proc)) {
+			pr_err(NULL, "dsp detach failed");
+			ret = false;
+		}
+		if (dsp_close(shared.handle) < 0)
+			ret = false;
+		shared.handle = -1;
+		shared.proc = NULL;
+	}
+
+	return ret;
+}
+
+/* the element's own reference; the handle might stay open for others */
+bool gstdsp_close(int handle,
+		  bool error)
+{
+	bool ret;
+
+	G_LOCK(shared);
+
+	if (error)
+		shared.error = true;
+	ret = handle_unref(handle);
+
+	G_UNLOCK(shared);
+	return ret;
+}
+
+void gstdsp_handle_ref(int handle)
+{
+	guint refs;
+
+	G_LOCK(shared);
+	refs = GPOINTER_TO_UINT(g_hash_table_lookup(shared.refs, GINT_TO_POINTER(handle)));
+	g_hash_table_insert(shared.refs, GINT_TO_POINTER(handle), GUINT_TO_POINTER(refs + 1));
+	G_UNLOCK(shared);
+}
+
+void gstdsp_handle_unref(int handle)
+{
+	G_LOCK(shared);
+	handle_unref(handle);
+	G_UNLOCK(shared);
+}
+
+/*
+ * The DCD registry is system-wide, and nobody unregisters, so each object
+ * has to be registered only once.
+ */
+
+struct registered {
+	struct dsp_uuid uuid;
+	int type;
+	char *filename;
+};
+
+static GSList *registry;
+
+G_LOCK_DEFINE_STATIC(registry);
+
+static inline bool
+is_registered(const struct dsp_uuid *uuid,
+	      int type,
+	      const char *filename)
+{
+	GSList *l;
+
+	for (l = registry; l; l = l->next) {
+		struct registered *r = l->data;
+		if (r->type == type && !memcmp(&r->uuid, uuid, sizeof(*uuid)) &&
+		    !strcmp(r->filename, filename))
+			return true;
+	}
+
+	return false;
+}
+
 bool gstdsp_register(int dsp_handle,
 		     const struct dsp_uuid *uuid,
 		     int type,
 		     const char *filename)
 {
+	struct registered *r;
 	gchar *path;
-	path = g_build_filename(DSPDIR, filename, NULL);
-	if (!dsp_register(dsp_handle, uuid, type, path)) {
-		g_free(path);
-		return false;
-	}
+	bool ret = true;
+
+	G_LOCK(registry);
+
+	if (is_registered(uuid, type, filename))
+		goto leave;
 
+	path = g_build_filename(DSPDIR, filename, NULL);
+	ret = dsp_register(dsp_handle, uuid, type, path);
 	g_free(path);
-	return true;
+	if (!ret)
+		goto leave;
+
+	r = g_new(struct registered, 1);
+	r->uuid = *uuid;
+	r->type = type;
+	r->filename = g_strdup(filename);
+	registry = g_slist_prepend(registry, r);
+
+leave:
+	G_UNLOCK(registry);
+	return ret;
 }
 
 static inline bool
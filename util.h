@@ -16,6 +16,11 @@
 
 struct _GstBuffer;
 
+int gstdsp_open(void **proc);
+bool gstdsp_close(int handle, bool error);
+void gstdsp_handle_ref(int handle);
+void gstdsp_handle_unref(int handle);
+
 bool gstdsp_register(int dsp_handle,
 		     const struct dsp_uuid *uuid,
 		     int type,